@@ -0,0 +1,113 @@
+/*
+** epoch.c -- epoch based reclamation for the lock-free read path
+**
+** Readers follow head and next pointers without any lock. A reader announces
+** the global epoch in its slot before loading head; a writer that unlinks a
+** node stamps it with the epoch; the epoch is bumped once per batch of retired
+** nodes, just before they are checked. A node is freed once every reader
+** inside a read section announced a later epoch: those readers loaded head
+** after the unlink, so none of them can reach it.
+** A reader holds a slot only inside a read section, so any number of
+** threads can read as long as at most EPOCH_READERS do it at the same time.
+** A read section costs a CAS, two stores and a fence, it never waits for a writer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "synchronization.h"
+#include "epoch.h"
+#include "myMalloc.h"
+#include "lockprof.h"
+
+typedef struct Slot {
+    unsigned long epoch; // announced epoch + 1, 0 when outside a read section
+    int used;
+} __attribute__((aligned(64))) Slot;
+
+static Slot slots[EPOCH_READERS];
+static unsigned long global_epoch __attribute__((aligned(64))) = 0;
+static ProfLock limbo_lock = PROF_LOCK_INITIALIZER("epoch limbo");
+static Limbo limbo = {NULL, 0, 0}; // nodes retired with epoch_retire
+static unsigned int next_hint = 0;
+static __thread int my_hint = -1;     // where this thread looks for a free slot first
+static __thread Slot *my_slot = NULL; // held between epoch_enter and epoch_exit
+
+// a free slot, normally the one this thread used last time
+static Slot *claim_slot(void) {
+    if (my_hint == -1)
+        my_hint = (int) (__atomic_fetch_add(&next_hint, 1, __ATOMIC_RELAXED) % EPOCH_READERS);
+    while (1) {
+        for (int n = 0; n < EPOCH_READERS; ++n) {
+            int i = (my_hint + n) % EPOCH_READERS, unused = 0;
+            if (!__atomic_load_n(&slots[i].used, __ATOMIC_RELAXED)
+                && __atomic_compare_exchange_n(&slots[i].used, &unused, 1, 0,
+                                               __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                my_hint = i;
+                return &slots[i];
+            }
+        }
+        sched_yield(); // more than EPOCH_READERS read sections at once, they are short
+    }
+}
+
+void epoch_enter(void) {
+    my_slot = claim_slot();
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&my_slot->epoch, e + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // announced before head is loaded
+}
+
+void epoch_exit(void) {
+    __atomic_store_n(&my_slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&my_slot->used, 0, __ATOMIC_RELEASE);
+    my_slot = NULL;
+}
+
+// oldest epoch a reader may still be in, (unsigned long) -1 when there is none
+static unsigned long min_active(void) {
+    unsigned long min = (unsigned long) -1;
+    for (int i = 0; i < EPOCH_READERS; ++i) {
+        unsigned long e = __atomic_load_n(&slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (e && e - 1 < min)
+            min = e - 1;
+    }
+    return min;
+}
+
+pStack epoch_retire_to(Limbo *l, pStack node) {
+    node->retired = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    node->limbo = l->head;
+    l->head = node;
+    if (++l->len < (l->scan_at > EPOCH_BATCH ? l->scan_at : EPOCH_BATCH))
+        return NULL;
+    // readers entering from now on can't reach any node of the list
+    __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    unsigned long min = min_active();
+    pStack ready = NULL;
+    for (pStack *pp = &l->head; *pp != NULL;) {
+        if ((*pp)->retired < min) {
+            pStack done = *pp;
+            *pp = done->limbo;
+            done->limbo = ready;
+            ready = done;
+            l->len--;
+        } else {
+            pp = &(*pp)->limbo;
+        }
+    }
+    l->scan_at = l->len + EPOCH_BATCH; // a slow reader doesn't make every retire scan
+    return ready;
+}
+
+void epoch_retire(pStack node) {
+    prof_lock(&limbo_lock);
+    pStack ready = epoch_retire_to(&limbo, node);
+    prof_unlock(&limbo_lock);
+    while (ready != NULL) { // free outside limbo_lock
+        pStack next = ready->limbo;
+        _free(ready);
+        ready = next;
+    }
+}
@@ -0,0 +1,27 @@
+/*
+** epoch.h -- epoch based reclamation for the lock-free read path
+*/
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include "synchronization.h"
+
+#define EPOCH_READERS 256 // threads that can be inside a read section at once
+
+#define EPOCH_BATCH 64    // retired nodes collected before trying to free them
+
+// retired nodes of one owner, who serializes the calls (e.g. under its lock)
+typedef struct Limbo {
+    pStack head;  // linked through limbo
+    int len;
+    int scan_at;  // len at which the next scan for reusable nodes is done
+} Limbo;
+
+void epoch_enter(void);         // start of a read section
+void epoch_exit(void);          // end of a read section
+void epoch_retire(pStack node); // node is unlinked, _free it once no reader can see it
+pStack epoch_retire_to(Limbo *l, pStack node); // same, but returns the nodes no reader can see
+                                               // any more, linked through limbo, for reuse
+
+#endif
@@ -0,0 +1,175 @@
+/*
+** lockprof.c -- contention profiling of the server's locks
+**
+** Every acquisition is counted per lock and per operation (push, pop, top,
+** other), and a trylock first tells whether it was contended. Only one in
+** prof_every acquisitions of a thread reads the clock to time the wait and
+** the hold, which keeps the cost low enough to leave on in production.
+** Disabled, a ProfLock is a plain mutex plus one branch.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "lockprof.h"
+
+static unsigned int prof_every = 0;
+static ProfLock *locks = NULL; // every lock acquired since profiling was enabled
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_thread_id = 0;
+static __thread unsigned int t_id = 0;
+static __thread unsigned int t_count = 0;
+static __thread int t_op = PROF_OTHER;
+
+static const char *op_name[PROF_OPS] = {"push", "pop", "top", "other"};
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int bucket(unsigned long ns) {
+    int b = ns ? 64 - __builtin_clzl(ns) : 0; // ns < 2^b
+    return b < PROF_BUCKETS ? b : PROF_BUCKETS - 1;
+}
+
+// before taking l: report may be holding other profiled locks
+static void register_lock(ProfLock *l) {
+    pthread_mutex_lock(&registry_lock);
+    if (!l->registered) {
+        l->next = locks;
+        __atomic_store_n(&locks, l, __ATOMIC_RELEASE);
+        __atomic_store_n(&l->registered, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void prof_init(ProfLock *l, const char *name) {
+    memset(l, 0, sizeof(ProfLock));
+    pthread_mutex_init(&l->mutex, NULL);
+    l->name = name;
+}
+
+void prof_enable(unsigned int every) {
+    prof_every = every;
+}
+
+void prof_op(int op) {
+    t_op = op;
+}
+
+void prof_lock(ProfLock *l) {
+    if (!prof_every) {
+        pthread_mutex_lock(&l->mutex);
+        return;
+    }
+    if (!__atomic_load_n(&l->registered, __ATOMIC_ACQUIRE))
+        register_lock(l);
+    int sample = ++t_count >= prof_every;
+    unsigned long start = 0;
+    if (sample) {
+        t_count = 0;
+        start = now_ns();
+    }
+    int contended = pthread_mutex_trylock(&l->mutex) != 0;
+    if (contended)
+        pthread_mutex_lock(&l->mutex);
+    if (t_id == 0)
+        t_id = __atomic_add_fetch(&next_thread_id, 1, __ATOMIC_RELAXED);
+    ProfStats *st = &l->stats[t_op];
+    st->acquires++;
+    st->contended += contended;
+    if (l->owner != t_id) {
+        st->handoffs++;
+        l->owner = t_id;
+    }
+    if (sample) {
+        unsigned long now = now_ns(), wait = now - start;
+        st->sampled++;
+        st->wait_ns += wait;
+        st->wait_hist[bucket(wait)]++;
+        l->held_since = now;
+        l->held_op = t_op;
+    }
+}
+
+void prof_unlock(ProfLock *l) {
+    if (l->held_since) {
+        unsigned long hold = now_ns() - l->held_since;
+        ProfStats *st = &l->stats[l->held_op];
+        st->hold_ns += hold;
+        st->hold_hist[bucket(hold)]++;
+        l->held_since = 0;
+    }
+    pthread_mutex_unlock(&l->mutex);
+}
+
+static void print_ns(FILE *f, unsigned long ns) {
+    if (ns < 1000)
+        fprintf(f, "%luns", ns);
+    else if (ns < 1000000)
+        fprintf(f, "%.1fus", ns / 1e3);
+    else
+        fprintf(f, "%.1fms", ns / 1e6);
+}
+
+// upper bound of the bucket holding the p-th percentile
+static unsigned long percentile(const unsigned long *hist, unsigned long n, int p) {
+    unsigned long seen = 0, want = (n * p + 99) / 100;
+    for (int b = 0; b < PROF_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen >= want && seen)
+            return 1UL << b;
+    }
+    return 1UL << (PROF_BUCKETS - 1);
+}
+
+static void print_hist(FILE *f, const char *what, const unsigned long *hist,
+                       unsigned long total_ns, unsigned long n) {
+    fprintf(f, "      %s avg ", what);
+    print_ns(f, total_ns / n);
+    fprintf(f, ", p50 <");
+    print_ns(f, percentile(hist, n, 50));
+    fprintf(f, ", p99 <");
+    print_ns(f, percentile(hist, n, 99));
+    fprintf(f, ":");
+    for (int b = 0; b < PROF_BUCKETS; ++b) {
+        if (!hist[b])
+            continue;
+        fprintf(f, " <");
+        print_ns(f, 1UL << b);
+        fprintf(f, " %lu", hist[b]);
+    }
+    fprintf(f, "\n");
+}
+
+void prof_report(FILE *f) {
+    if (!prof_every) {
+        fprintf(f, "lock profile: disabled (start the server with -L)\n");
+        return;
+    }
+    fprintf(f, "lock profile: 1 in %u acquisitions timed\n", prof_every);
+    // locks are only ever added at the head, so the list can be walked unlocked
+    for (ProfLock *l = __atomic_load_n(&locks, __ATOMIC_ACQUIRE); l != NULL; l = l->next) {
+        ProfStats stats[PROF_OPS];
+        pthread_mutex_lock(&l->mutex); // a consistent copy
+        memcpy(stats, l->stats, sizeof stats);
+        pthread_mutex_unlock(&l->mutex);
+        fprintf(f, "  %s\n", l->name);
+        for (int op = 0; op < PROF_OPS; ++op) {
+            ProfStats *st = &stats[op];
+            if (!st->acquires)
+                continue;
+            fprintf(f, "    %-5s %lu acquires, %.1f%% contended, %lu handoffs, %lu timed\n",
+                    op_name[op], st->acquires, 100.0 * st->contended / st->acquires,
+                    st->handoffs, st->sampled);
+            if (st->sampled) {
+                print_hist(f, "wait", st->wait_hist, st->wait_ns, st->sampled);
+                print_hist(f, "hold", st->hold_hist, st->hold_ns, st->sampled);
+            }
+        }
+    }
+    fflush(f);
+}
@@ -0,0 +1,52 @@
+/*
+** lockprof.h -- contention profiling of the server's locks
+*/
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define PROF_PUSH 0
+#define PROF_POP 1
+#define PROF_TOP 2   // TOP, DEPTH and PEEK
+#define PROF_OTHER 3 // replication, timers, ...
+#define PROF_OPS 4
+
+#define PROF_BUCKETS 32 // log2 histogram of ns, the last one takes everything above 1s
+
+typedef struct ProfStats {
+    unsigned long acquires;
+    unsigned long contended; // the lock was held by another thread
+    unsigned long handoffs;  // acquired by another thread than the previous holder
+    unsigned long sampled;
+    unsigned long wait_ns;
+    unsigned long hold_ns;
+    unsigned long wait_hist[PROF_BUCKETS];
+    unsigned long hold_hist[PROF_BUCKETS];
+} ProfStats;
+
+// a pthread mutex that counts and times its acquisitions; the stats are
+// updated while holding the mutex, so they need no atomics
+typedef struct ProfLock {
+    pthread_mutex_t mutex;
+    const char *name;
+    int registered;
+    unsigned int owner;          // id of the last holder
+    unsigned long held_since;    // ns, 0 when this hold is not sampled
+    int held_op;
+    ProfStats stats[PROF_OPS];
+    struct ProfLock *next;
+} ProfLock;
+
+#define PROF_LOCK_INITIALIZER(name) {PTHREAD_MUTEX_INITIALIZER, name}
+
+void prof_init(ProfLock *l, const char *name);
+void prof_lock(ProfLock *l);
+void prof_unlock(ProfLock *l);
+void prof_op(int op);                  // what the calling thread is doing now
+void prof_enable(unsigned int every);  // time 1 in every acquisitions of each thread
+void prof_report(FILE *f);
+
+#endif
@@ -2,13 +2,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "myMalloc.h"
+#include "lockprof.h"
 
 typedef struct block {
     size_t size;
+    unsigned long arena; // index of the arena the block belongs to
     struct block *next;
     struct block *prev;
 } block;
 
+/*
+ * Arena 0 is the brk heap. With malloc_init_nodes() there is one more arena
+ * per NUMA node, grown with mmap'd chunks bound to that node, and each
+ * thread allocates from the arena of the node it was placed on.
+ * A block always goes back to the arena it came from.
+ */
+typedef struct arena {
+    block *head;
+    ProfLock lock;        // the stack shards allocate concurrently
+    int node;             // sysfs node number, -1 for the brk heap
+} arena;
+
 #ifndef ALLOC_UNIT
 #define ALLOC_UNIT 3 * sysconf(_SC_PAGESIZE)
 #endif
@@ -17,17 +35,28 @@ typedef struct block {
 #define MIN_DEALLOC 1 * sysconf(_SC_PAGESIZE)
 #endif
 
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK 64 * sysconf(_SC_PAGESIZE)
+#endif
+
+#define MAX_ARENAS 65
+
+#define MPOL_PREFERRED 1
+
 #define BLOCK_MEM(ptr) ((void *)((unsigned long)ptr + sizeof(block)))
 #define BLOCK_HEADER(ptr) ((void *)((unsigned long)ptr - sizeof(block)))
 
-static block *mHead = NULL;
+static arena arenas[MAX_ARENAS] = {{NULL, PROF_LOCK_INITIALIZER("malloc brk heap"), -1}};
+static char arena_name[MAX_ARENAS][32];
+static int num_arenas = 1;
+static __thread int tArena = 0; // arena of the calling thread
 
-void remove_block(block *ptr) {
+void remove_block(arena *a, block *ptr) {
     if (!ptr->prev) {
         if (ptr->next) {
-            mHead = ptr->next;
+            a->head = ptr->next;
         } else {
-            mHead = NULL;
+            a->head = NULL;
         }
     } else {
         ptr->prev->next = ptr->next;
@@ -45,66 +74,97 @@ block *split(block *ptr, size_t size) {
     return newptr;
 }
 
-void add_block(block *b) {
+void add_block(arena *a, block *b) {
+    b->arena = a - arenas;
     b->prev = NULL;
     b->next = NULL;
-    if (!mHead || (unsigned long) mHead > (unsigned long) b) {
-        if (mHead) {
-            mHead->prev = b;
+    if (!a->head || (unsigned long) a->head > (unsigned long) b) {
+        if (a->head) {
+            a->head->prev = b;
         }
-        b->next = mHead;
-        mHead = b;
+        b->next = a->head;
+        a->head = b;
     } else {
-        block *curr = mHead;
+        block *curr = a->head;
         while (curr->next
                && (unsigned long) curr->next < (unsigned long) b) {
             curr = curr->next;
         }
         b->next = curr->next;
+        b->prev = curr;
+        if (curr->next) {
+            curr->next->prev = b;
+        }
         curr->next = b;
     }
 }
 
-void *_malloc(size_t size) {
+// a new chunk for a node arena, placed on its node
+static block *chunk_alloc(arena *a, size_t alloc_size) {
+    void *mem = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    unsigned long mask[MAX_ARENAS / 64 + 1] = {0};
+    if (a->node < (int) sizeof(mask) * 8) {
+        mask[a->node / 64] = 1UL << (a->node % 64);
+        // without kernel NUMA support this fails and first touch places the pages
+        syscall(SYS_mbind, mem, alloc_size, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+    }
+    return (block *) mem;
+}
+
+static void *malloc_locked(arena *a, size_t size) {
     void *block_mem;
     block *ptr, *newptr;
-    size_t alloc_size = size >= ALLOC_UNIT ? size + sizeof(block)
-                                           : ALLOC_UNIT;
-    ptr = mHead;
+    size_t unit = a->node < 0 ? ALLOC_UNIT : ARENA_CHUNK;
+    size_t alloc_size = size >= unit ? size + sizeof(block)
+                                     : unit;
+    ptr = a->head;
     while (ptr) {
         if (ptr->size >= size + sizeof(block)) {
             block_mem = BLOCK_MEM(ptr);
-            remove_block(ptr);
+            remove_block(a, ptr);
             if (ptr->size == size) { // found a perfect sized block
                 return block_mem;
             }
             // our block is bigger then requested, split it and add
             newptr = split(ptr, size);
-            add_block(newptr);
+            add_block(a, newptr);
             return block_mem;
         } else {
             ptr = ptr->next;
         }
     }
-    ptr = sbrk(alloc_size);
-    if (!ptr) {
+    ptr = a->node < 0 ? sbrk(alloc_size) : chunk_alloc(a, alloc_size);
+    if (!ptr || ptr == (void *) -1) {
         printf("failed to alloc %ld\n", alloc_size);
         return NULL;
     }
+    ptr->arena = a - arenas;
     ptr->next = NULL;
     ptr->prev = NULL;
     ptr->size = alloc_size - sizeof(block);
     if (alloc_size > size + sizeof(block)) {
         newptr = split(ptr, size);
-        add_block(newptr);
+        add_block(a, newptr);
     }
     return BLOCK_MEM(ptr);
 }
 
 
-void _free(void *ptr) {
-    add_block(BLOCK_HEADER(ptr));
-    block *curr = mHead;
+void *_malloc(size_t size) {
+    arena *a = &arenas[tArena];
+    prof_lock(&a->lock);
+    void *ptr = malloc_locked(a, size);
+    prof_unlock(&a->lock);
+    return ptr;
+}
+
+static void free_locked(arena *a, void *ptr) {
+    add_block(a, BLOCK_HEADER(ptr));
+    block *curr = a->head;
     unsigned long header_curr, header_next;
     unsigned long program_break = (unsigned long) sbrk(0);
     if (program_break == 0) {
@@ -125,16 +185,44 @@ void _free(void *ptr) {
         }
         curr = curr->next;
     }
+    if (a->node >= 0) { // node arenas keep their chunks
+        return;
+    }
     header_curr = (unsigned long) curr;
     if (header_curr + curr->size + sizeof(block) == program_break
         && curr->size >= MIN_DEALLOC) {
-        remove_block(curr);
+        remove_block(a, curr);
         if (brk(curr) != 0) {
             printf("error freeing memory\n");
         }
     }
 }
 
+void _free(void *ptr) {
+    arena *a = &arenas[((block *) BLOCK_HEADER(ptr))->arena];
+    prof_lock(&a->lock);
+    free_locked(a, ptr);
+    prof_unlock(&a->lock);
+}
+
+int malloc_init_nodes(int nnodes, const int *ids) {
+    if (nnodes < 1 || nnodes >= MAX_ARENAS) {
+        return -1;
+    }
+    for (int i = 0; i < nnodes; ++i) {
+        arenas[i + 1].head = NULL;
+        sprintf(arena_name[i + 1], "malloc node%d", ids[i]);
+        prof_init(&arenas[i + 1].lock, arena_name[i + 1]);
+        arenas[i + 1].node = ids[i];
+    }
+    num_arenas = nnodes + 1;
+    return 0;
+}
+
+void malloc_set_node(int node) {
+    tArena = node >= 0 && node + 1 < num_arenas ? node + 1 : 0;
+}
+
 void *_calloc(size_t nsize, size_t size) {
     size_t newsize = size*nsize;
     void *ptr;
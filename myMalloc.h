@@ -0,0 +1,13 @@
+#ifndef MYMALLOC_H
+#define MYMALLOC_H
+
+#include <stddef.h>
+
+void *_malloc(size_t size);
+void _free(void *ptr);
+void *_calloc(size_t nsize, size_t size);
+
+int malloc_init_nodes(int nnodes, const int *ids); // one arena per NUMA node
+void malloc_set_node(int node);                    // calling thread allocates on this node
+
+#endif
@@ -0,0 +1,171 @@
+/*
+** parser.c -- streaming parser for the text protocol
+**
+** Commands end with '\0' (client, test) or '\n' (terminals, nc), so one recv
+** can carry many of them, and one command can be split over several recvs.
+** The end of each command is found 32 or 16 bytes at a time with AVX2 or
+** SSE2 (chosen once at startup), and the opcode is dispatched on its first
+** four bytes read as one word instead of trying the prefixes in turn.
+** Commands are terminated in place, nothing is copied.
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include "parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define WORD(a, b, c, d) ((uint32_t) (a) | (uint32_t) (b) << 8 | (uint32_t) (c) << 16 | (uint32_t) (d) << 24)
+
+static size_t scan_scalar(const char *s, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        if (s[i] == '\0' || s[i] == '\n')
+            return i;
+    return n;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *s, size_t n) {
+    const __m128i zero = _mm_setzero_si128(), nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, nl)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *s, size_t n) {
+    const __m256i zero = _mm256_setzero_si256(), nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, zero), _mm256_cmpeq_epi8(v, nl)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_sse2(s + i, n - i);
+}
+#endif
+
+// offset of the first '\0' or '\n' in s[0..n), n if there is none
+static size_t (*scan)(const char *s, size_t n) = NULL;
+static const char *isa = "scalar";
+
+static void pick_scanner(void) {
+    scan = scan_scalar;
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+        isa = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan = scan_sse2;
+        isa = "sse2";
+    }
+#endif
+}
+
+const char *parser_isa(void) {
+    if (scan == NULL)
+        pick_scanner();
+    return isa;
+}
+
+void parser_init(Parser *p) {
+    if (scan == NULL)
+        pick_scanner();
+    p->start = p->end = 0;
+    p->skipping = 0;
+}
+
+char *parser_space(Parser *p, size_t *room) {
+    if (p->start == p->end) {
+        p->start = p->end = 0;
+    } else if (p->end == PARSE_BUF && p->start > 0) { // move the partial command to the front
+        memmove(p->buf, p->buf + p->start, p->end - p->start);
+        p->end -= p->start;
+        p->start = 0;
+    }
+    *room = PARSE_BUF - p->end;
+    return p->buf + p->end;
+}
+
+void parser_filled(Parser *p, size_t n) {
+    p->end += n;
+}
+
+int parser_pending(Parser *p) {
+    return p->end > p->start && !p->skipping;
+}
+
+// opcode from the first bytes, same prefixes the server always accepted
+static int opcode(const char *s, size_t len) {
+    uint32_t w = WORD(len > 0 ? s[0] : 0, len > 1 ? s[1] : 0, len > 2 ? s[2] : 0, len > 3 ? s[3] : 0);
+    switch (w) {
+        case WORD('S', 'T', 'O', 'P'):
+            return CMD_STOP;
+        case WORD('P', 'U', 'S', 'H'):
+            return len > 4 && s[4] == ' ' ? CMD_PUSH : CMD_NONE;
+        case WORD('B', 'P', 'O', 'P'):
+            return CMD_BPOP;
+        case WORD('D', 'E', 'P', 'T'):
+            return len > 4 && s[4] == 'H' ? CMD_DEPTH : CMD_NONE;
+        case WORD('P', 'E', 'E', 'K'):
+            return CMD_PEEK;
+    }
+    switch (w & 0xffffff) {
+        case WORD('P', 'O', 'P', 0):
+            return CMD_POP;
+        case WORD('T', 'O', 'P', 0):
+            return CMD_TOP;
+    }
+    return CMD_NONE;
+}
+
+int parser_next(Parser *p, Command *cmd) {
+    while (p->start < p->end) {
+        char *line = p->buf + p->start;
+        size_t n = p->end - p->start;
+        size_t len = scan(line, n);
+        if (len == n) { // no end yet
+            if (p->skipping || n > PARSE_LINE_MAX) {
+                p->start = p->end;
+                if (!p->skipping) {
+                    p->skipping = 1;
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        p->start += len + 1;
+        if (p->skipping) { // the end of a dropped command
+            p->skipping = 0;
+            continue;
+        }
+        if (len > PARSE_LINE_MAX)
+            return -1;
+        if (len && line[len - 1] == '\r')
+            len--;
+        if (len == 0) // empty, e.g. the '\0' after "TOP\n"
+            continue;
+        line[len] = '\0';
+        cmd->op = opcode(line, len);
+        cmd->line = line;
+        cmd->arg = line + (len < 4 ? len : 4);
+        if (cmd->op == CMD_PUSH || cmd->op == CMD_DEPTH)
+            cmd->arg = line + 5;
+        else if (cmd->op == CMD_POP || cmd->op == CMD_TOP)
+            cmd->arg = line + 3;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+** parser.h -- streaming parser for the text protocol
+*/
+
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h>
+
+#define PARSE_BUF 8192      // input buffered per connection, many pipelined commands per recv
+
+#define PARSE_LINE_MAX 1023 // longer commands are dropped (same limit as the old single recv)
+
+#define CMD_NONE 0          // unknown, ignored
+#define CMD_PUSH 1
+#define CMD_POP 2
+#define CMD_BPOP 3
+#define CMD_TOP 4
+#define CMD_DEPTH 5
+#define CMD_PEEK 6
+#define CMD_STOP 7
+
+typedef struct Command {
+    int op;
+    char *line; // the whole command, '\0' terminated, inside the parser buffer
+    char *arg;  // what follows the opcode
+} Command;
+
+typedef struct Parser {
+    char buf[PARSE_BUF];
+    size_t start;  // first byte not parsed yet
+    size_t end;    // end of the received bytes
+    int skipping;  // dropping a command longer than PARSE_LINE_MAX
+} Parser;
+
+void parser_init(Parser *p);
+char *parser_space(Parser *p, size_t *room); // where to recv into
+void parser_filled(Parser *p, size_t n);
+int parser_next(Parser *p, Command *cmd);    // 1 with a command, 0 when it needs more bytes, -1 on a too long command
+int parser_pending(Parser *p);               // part of a command is buffered
+const char *parser_isa(void);                // the scanner in use
+
+#endif
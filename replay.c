@@ -0,0 +1,298 @@
+/*
+** replay.c -- re-sends a trace recorded with 'server -r' against a server
+**
+** usage: replay [-s speed] [-c connections] [-p port] hostname tracefile
+**   -s 1   original timing (default), -s N  N times faster, -s 0  as fast as possible
+**   -c N   at most N connections open at once (default 100)
+**
+** Every recorded connection is replayed on a socket of its own, opened for
+** its first record and closed after its last one, so the byte stream of each
+** connection reaches the server exactly as it was recorded. -c workers take
+** the recorded connections in the order they started.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include "trace.h"
+
+#define PORT "3490" // the port client will be connecting to
+
+#define MAX_OPEN 100 // default of -c
+
+typedef struct Session {
+    uint32_t conn;      // recorded connection id
+    pTraceRecord *recs; // its records, in order
+    size_t n;
+    size_t cap;
+} Session;
+
+typedef struct Worker {
+    pthread_t thread;
+    size_t sent;
+    size_t failed;      // records not sent: no connection, or the server closed it
+    size_t cmds;        // commands in the records sent
+} Worker;
+
+static const char *host;
+static const char *port = PORT;
+static double speed = 1.0;
+static struct timespec start;
+static Session *sessions;
+static size_t nsessions = 0;
+static size_t next_session = 0; // taken by the workers in order of their first record
+static size_t *by_conn;         // hash of connection id -> session index + 1
+static size_t by_conn_size = 0;
+static uint64_t *lag;           // ns between scheduled and actual send, per record sent
+static size_t nlag = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) (ts.tv_sec - start.tv_sec) * 1000000000ULL + ts.tv_nsec - start.tv_nsec;
+}
+
+static int connect_server(void) {
+    struct addrinfo hints, *servinfo, *p;
+    int sockfd = -1, rv, one = 1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (sockfd != -1) // one record per segment, as it was received
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return sockfd;
+}
+
+// commands end with '\0' or '\n'
+static size_t count_cmds(const pTraceRecord rec) {
+    size_t n = 0;
+    for (uint32_t i = 0; i < rec->len; ++i)
+        n += rec->data[i] == '\0' || rec->data[i] == '\n';
+    return n;
+}
+
+static void replay_session(Worker *w, Session *s) {
+    size_t i = 0;
+    uint64_t due = speed > 0 ? (uint64_t) (s->recs[0]->ts / speed) : 0;
+    uint64_t now = now_ns();
+    if (due > now) { // connect when the recorded connection sent its first record
+        struct timespec ts = {(time_t) ((due - now) / 1000000000ULL), (long) ((due - now) % 1000000000ULL)};
+        nanosleep(&ts, NULL);
+    }
+    int sockfd = connect_server();
+    if (sockfd == -1) {
+        fprintf(stderr, "replay: failed to connect for connection %u\n", s->conn);
+        w->failed += s->n;
+        return;
+    }
+    for (; i < s->n; ++i) {
+        due = speed > 0 ? (uint64_t) (s->recs[i]->ts / speed) : 0;
+        now = now_ns();
+        if (due > now) {
+            struct timespec ts = {(time_t) ((due - now) / 1000000000ULL),
+                                  (long) ((due - now) % 1000000000ULL)};
+            nanosleep(&ts, NULL);
+            now = now_ns();
+        }
+        // the server may have closed it (STOP, -i, -d): an error, not SIGPIPE
+        if (send(sockfd, s->recs[i]->data, s->recs[i]->len, MSG_NOSIGNAL) == -1) {
+            if (errno != EPIPE && errno != ECONNRESET)
+                perror("Send error");
+            break;
+        }
+        lag[__atomic_fetch_add(&nlag, 1, __ATOMIC_RELAXED)] = speed > 0 && now > due ? now - due : 0;
+        w->sent++;
+        w->cmds += count_cmds(s->recs[i]);
+    }
+    w->failed += s->n - i;
+    close(sockfd);
+}
+
+static void *worker_fun(void *arg) {
+    Worker *w = (Worker *) arg;
+    size_t k;
+    while ((k = __atomic_fetch_add(&next_session, 1, __ATOMIC_RELAXED)) < nsessions)
+        replay_session(w, &sessions[k]);
+    return NULL;
+}
+
+// the session of a connection id, a new one at its first record
+static Session *session_of(uint32_t conn) {
+    if (2 * (nsessions + 1) > by_conn_size) { // grow and rehash, keep it at most half full
+        size_t old_size = by_conn_size, *old = by_conn;
+        by_conn_size = by_conn_size ? by_conn_size * 2 : 256;
+        by_conn = calloc(by_conn_size, sizeof(size_t));
+        sessions = realloc(sessions, by_conn_size / 2 * sizeof(Session));
+        if (by_conn == NULL || sessions == NULL) {
+            perror("Malloc failed");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_size; ++i) {
+            if (!old[i])
+                continue;
+            size_t h = sessions[old[i] - 1].conn * 2654435761U & (by_conn_size - 1);
+            while (by_conn[h])
+                h = (h + 1) & (by_conn_size - 1);
+            by_conn[h] = old[i];
+        }
+        free(old);
+    }
+    size_t h = conn * 2654435761U & (by_conn_size - 1);
+    while (by_conn[h]) {
+        if (sessions[by_conn[h] - 1].conn == conn)
+            return &sessions[by_conn[h] - 1];
+        h = (h + 1) & (by_conn_size - 1);
+    }
+    Session *s = &sessions[nsessions++];
+    memset(s, 0, sizeof(Session));
+    s->conn = conn;
+    by_conn[h] = nsessions;
+    return s;
+}
+
+static int cmp_first(const void *a, const void *b) {
+    uint64_t x = ((const Session *) a)->recs[0]->ts, y = ((const Session *) b)->recs[0]->ts;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    int nconn = MAX_OPEN, opt;
+
+    while ((opt = getopt(argc, argv, "s:c:p:")) != -1) {
+        switch (opt) {
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'c':
+                nconn = atoi(optarg);
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            default:
+                nconn = 0;
+        }
+    }
+    if (nconn < 1 || speed < 0 || argc - optind != 2) {
+        fprintf(stderr, "usage: replay [-s speed] [-c max_open] [-p port] hostname tracefile\n");
+        exit(1);
+    }
+    host = argv[optind];
+
+    FILE *f = fopen(argv[optind + 1], "rb");
+    if (f == NULL) {
+        perror("replay: fopen");
+        exit(1);
+    }
+    if (trace_read_header(f) == -1) {
+        fprintf(stderr, "replay: not a trace file\n");
+        exit(1);
+    }
+
+    size_t total = 0, total_cmds = 0;
+    uint64_t last_ts = 0, first = UINT64_MAX, last = 0;
+    int rv;
+    while (1) {
+        pTraceRecord rec = malloc(sizeof(TraceRecord));
+        if (rec == NULL) {
+            perror("Malloc failed");
+            exit(1);
+        }
+        if ((rv = trace_read_record(f, rec, &last_ts)) != 1) {
+            free(rec);
+            break;
+        }
+        Session *s = session_of(rec->conn);
+        if (s->n == s->cap) {
+            s->cap = s->cap ? s->cap * 2 : 64;
+            s->recs = realloc(s->recs, s->cap * sizeof(pTraceRecord));
+        }
+        s->recs[s->n++] = rec;
+        total_cmds += count_cmds(rec);
+        if (rec->ts < first)
+            first = rec->ts;
+        if (rec->ts > last)
+            last = rec->ts;
+        total++;
+    }
+    fclose(f);
+    if (rv == -1)
+        fprintf(stderr, "replay: trace truncated, replaying the first %zu records\n", total);
+    if (total == 0) {
+        fprintf(stderr, "replay: empty trace\n");
+        exit(1);
+    }
+    // start the schedule at the first record, not at the moment recording began
+    for (size_t k = 0; k < nsessions; ++k)
+        for (size_t j = 0; j < sessions[k].n; ++j)
+            sessions[k].recs[j]->ts -= first;
+    qsort(sessions, nsessions, sizeof(Session), cmp_first);
+    if ((size_t) nconn > nsessions)
+        nconn = (int) nsessions;
+    Worker *workers = calloc(nconn, sizeof(Worker));
+    lag = malloc(total * sizeof(uint64_t));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nconn; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, &worker_fun, &workers[i]) != 0)
+            printf("Thread error\n");
+    }
+    for (int i = 0; i < nconn; ++i)
+        pthread_join(workers[i].thread, NULL);
+    uint64_t elapsed = now_ns();
+
+    size_t sent = 0, failed = 0, cmds = 0;
+    for (int i = 0; i < nconn; ++i) {
+        sent += workers[i].sent;
+        failed += workers[i].failed;
+        cmds += workers[i].cmds;
+    }
+    qsort(lag, sent, sizeof(uint64_t), cmp_u64);
+
+    double rec_sec = (last - first) / 1e9, play_sec = elapsed / 1e9;
+    printf("records:   %zu sent, %zu failed of %zu, %zu connection(s), at most %d open\n",
+           sent, failed, total, nsessions, nconn);
+    printf("commands:  %zu sent of %zu\n", cmds, total_cmds);
+    printf("recorded:  %.3f s, %.0f cmd/s\n", rec_sec, rec_sec > 0 ? total_cmds / rec_sec : 0);
+    printf("replayed:  %.3f s, %.0f cmd/s (%.2fx the recording", play_sec,
+           play_sec > 0 ? cmds / play_sec : 0, play_sec > 0 && rec_sec > 0 ? rec_sec / play_sec : 0);
+    if (speed > 0)
+        printf(", target %.2fx)\n", speed);
+    else
+        printf(", unthrottled)\n");
+    if (speed > 0 && sent) // how far behind the recorded schedule each record went out
+        printf("send lag:  p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               lag[sent / 2] / 1e6, lag[sent * 99 / 100] / 1e6, lag[sent - 1] / 1e6);
+    return 0;
+}
@@ -0,0 +1,537 @@
+/*
+** replication.c -- ships the PUSH/POP log of a primary to hot standby followers
+**
+** The primary numbers every mutation (LSN) and keeps the last REPL_LOG_SIZE
+** of them in a ring. Each follower connection has a shipper thread that
+** sends batches of the log without waiting for the previous one to be
+** acknowledged, up to REPL_WINDOW mutations ahead of the last ack.
+** A follower that is new, restarted against another primary run, or too far
+** behind for the ring gets a snapshot of the whole stack first and then the
+** log tail from the snapshot's LSN on.
+**
+** Frames: type (1 byte), payload length (4 bytes), payload. Integers are big endian.
+**   HELLO     run id (8), last applied LSN (8)                    follower -> primary
+**   ACK       last applied LSN (8)                                follower -> primary
+**   SNAPSHOT  run id (8), LSN (8), count (4), count x (len (2), bytes), bottom to top
+**   BATCH     count (4), count x (LSN (8), op (1), len (2), bytes)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include "replication.h"
+
+#define F_HELLO 'H'
+#define F_ACK 'A'
+#define F_SNAPSHOT 'S'
+#define F_BATCH 'B'
+
+typedef struct LogEntry {
+    unsigned long lsn;
+    char op;
+    unsigned short len;
+    char data[1024];
+} LogEntry;
+
+typedef struct Buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+typedef struct Follower {
+    int fd;
+    unsigned long acked; // protected by log_lock
+    int dead;            // protected by log_lock
+} Follower, *pFollower;
+
+typedef struct SnapCtx {
+    Buf *buf;
+    uint32_t count;
+} SnapCtx;
+
+static LogEntry ring[REPL_LOG_SIZE];
+static unsigned long last_lsn = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static int primary = 0;
+static int follower = 0;
+static uint64_t run_id;
+static int listen_fd;
+static repl_snapshot take_snapshot;
+static repl_apply apply;
+static char primary_host[256];
+static char primary_port[32];
+
+static void buf_put(Buf *b, const void *p, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->data = realloc(b->data, b->cap);
+        if (b->data == NULL) {
+            perror("Malloc failed");
+            exit(1);
+        }
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put_u8(Buf *b, uint8_t v) {
+    buf_put(b, &v, 1);
+}
+
+static void put_u16(Buf *b, uint16_t v) {
+    v = htobe16(v);
+    buf_put(b, &v, 2);
+}
+
+static void put_u32(Buf *b, uint32_t v) {
+    v = htobe32(v);
+    buf_put(b, &v, 4);
+}
+
+static void put_u64(Buf *b, uint64_t v) {
+    v = htobe64(v);
+    buf_put(b, &v, 8);
+}
+
+static uint16_t get_u16(const char *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return be16toh(v);
+}
+
+static uint32_t get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return be32toh(v);
+}
+
+static uint64_t get_u64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return be64toh(v);
+}
+
+// starts a frame, frame_end() fills in its length
+static void frame_begin(Buf *b, char type) {
+    b->len = 0;
+    put_u8(b, type);
+    put_u32(b, 0);
+}
+
+static void frame_end(Buf *b) {
+    uint32_t len = htobe32((uint32_t) (b->len - 5));
+    memcpy(b->data + 1, &len, 4);
+}
+
+static int send_all(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, char *p, size_t n) {
+    while (n) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r == 0)
+            return -1;
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int read_frame(int fd, char *type, Buf *payload) {
+    char hdr[5];
+    if (recv_all(fd, hdr, 5) == -1)
+        return -1;
+    *type = hdr[0];
+    payload->len = 0;
+    uint32_t len = get_u32(hdr + 1);
+    if (len > (1 << 30))
+        return -1;
+    if (payload->cap < len || payload->data == NULL) {
+        payload->cap = len + 64;
+        payload->data = realloc(payload->data, payload->cap);
+        if (payload->data == NULL)
+            return -1;
+    }
+    if (recv_all(fd, payload->data, len) == -1)
+        return -1;
+    payload->len = len;
+    return 0;
+}
+
+void repl_log(int op, const char *str) {
+    if (!primary)
+        return;
+    pthread_mutex_lock(&log_lock);
+    LogEntry *e = &ring[(last_lsn + 1) & (REPL_LOG_SIZE - 1)];
+    e->lsn = last_lsn + 1;
+    e->op = (char) op;
+    e->len = str ? (unsigned short) strlen(str) : 0;
+    if (e->len)
+        memcpy(e->data, str, e->len);
+    last_lsn = e->lsn;
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+unsigned long repl_lsn(void) {
+    pthread_mutex_lock(&log_lock);
+    unsigned long lsn = last_lsn;
+    pthread_mutex_unlock(&log_lock);
+    return lsn;
+}
+
+int repl_is_follower(void) {
+    return follower;
+}
+
+static void snap_emit(void *ctx, const char *str) {
+    SnapCtx *s = (SnapCtx *) ctx;
+    uint16_t len = (uint16_t) strlen(str);
+    put_u16(s->buf, len);
+    buf_put(s->buf, str, len);
+    s->count++;
+}
+
+// returns the first LSN the follower needs after the snapshot
+static unsigned long send_snapshot(pFollower f, Buf *out) {
+    SnapCtx ctx = {out, 0};
+    frame_begin(out, F_SNAPSHOT);
+    put_u64(out, run_id);
+    put_u64(out, 0);
+    put_u32(out, 0);
+    unsigned long lsn = take_snapshot(snap_emit, &ctx);
+    uint64_t be_lsn = htobe64(lsn);
+    uint32_t be_count = htobe32(ctx.count);
+    memcpy(out->data + 13, &be_lsn, 8);
+    memcpy(out->data + 21, &be_count, 4);
+    frame_end(out);
+    if (send_all(f->fd, out->data, out->len) == -1)
+        return 0;
+    printf("replication: sent snapshot of %u items at lsn %lu\n", ctx.count, lsn);
+    return lsn + 1;
+}
+
+static void *ack_fun(void *arg) {
+    pFollower f = (pFollower) arg;
+    Buf in = {NULL, 0, 0};
+    char type;
+    while (read_frame(f->fd, &type, &in) == 0) {
+        if (type == F_ACK && in.len == 8) {
+            pthread_mutex_lock(&log_lock);
+            f->acked = get_u64(in.data);
+            pthread_cond_broadcast(&log_cond);
+            pthread_mutex_unlock(&log_lock);
+        }
+    }
+    pthread_mutex_lock(&log_lock);
+    f->dead = 1;
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+    free(in.data);
+    return NULL;
+}
+
+static void *ship_fun(void *arg) {
+    pFollower f = (pFollower) arg;
+    Buf in = {NULL, 0, 0}, out = {NULL, 0, 0};
+    char type;
+    pthread_t acker;
+    unsigned long next;
+
+    if (read_frame(f->fd, &type, &in) == -1 || type != F_HELLO || in.len != 16) {
+        close(f->fd);
+        free(in.data);
+        free(f);
+        return NULL;
+    }
+    uint64_t their_run = get_u64(in.data);
+    next = get_u64(in.data + 8) + 1;
+    if (their_run != run_id)
+        next = 0; // never synced with this primary run
+    f->acked = next ? next - 1 : 0;
+    if (pthread_create(&acker, NULL, &ack_fun, f) != 0) {
+        printf("Thread error\n");
+        close(f->fd);
+        free(f);
+        return NULL;
+    }
+    while (1) {
+        pthread_mutex_lock(&log_lock);
+        if (next == 0 || next > last_lsn + 1
+            || (last_lsn >= REPL_LOG_SIZE && next <= last_lsn - REPL_LOG_SIZE)) {
+            pthread_mutex_unlock(&log_lock); // the snapshot takes the stack lock
+            if ((next = send_snapshot(f, &out)) == 0)
+                break;
+            continue;
+        }
+        while (!f->dead && (next > last_lsn || next - 1 - f->acked >= REPL_WINDOW))
+            pthread_cond_wait(&log_cond, &log_lock);
+        if (f->dead) {
+            pthread_mutex_unlock(&log_lock);
+            break;
+        }
+        if (last_lsn >= REPL_LOG_SIZE && next <= last_lsn - REPL_LOG_SIZE) {
+            pthread_mutex_unlock(&log_lock); // overwritten while we waited for acks
+            continue;
+        }
+        uint32_t n = 0;
+        frame_begin(&out, F_BATCH);
+        put_u32(&out, 0);
+        for (; next <= last_lsn && n < REPL_BATCH; ++next, ++n) {
+            LogEntry *e = &ring[next & (REPL_LOG_SIZE - 1)];
+            put_u64(&out, e->lsn);
+            put_u8(&out, (uint8_t) e->op);
+            put_u16(&out, e->len);
+            buf_put(&out, e->data, e->len);
+        }
+        pthread_mutex_unlock(&log_lock);
+        uint32_t be_n = htobe32(n);
+        memcpy(out.data + 5, &be_n, 4);
+        frame_end(&out);
+        if (send_all(f->fd, out.data, out.len) == -1)
+            break;
+    }
+    printf("replication: follower disconnected\n");
+    shutdown(f->fd, SHUT_RDWR);
+    pthread_join(acker, NULL);
+    close(f->fd);
+    free(in.data);
+    free(out.data);
+    free(f);
+    return NULL;
+}
+
+static void *accept_fun(void *arg) {
+    (void) arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            perror("replication: accept");
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        pFollower f = (pFollower) calloc(1, sizeof(Follower));
+        if (f == NULL) {
+            perror("Malloc failed");
+            close(fd);
+            continue;
+        }
+        f->fd = fd;
+        pthread_t t;
+        if (pthread_create(&t, NULL, &ship_fun, f) != 0) {
+            printf("Thread error\n");
+            close(fd);
+            free(f);
+            continue;
+        }
+        pthread_detach(t);
+        printf("replication: follower connected\n");
+    }
+    return NULL;
+}
+
+int repl_primary(const char *port, repl_snapshot snapshot) {
+    struct addrinfo hints, *servinfo, *p;
+    int yes = 1, rv;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((listen_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if (bind(listen_fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(listen_fd);
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (p == NULL || listen(listen_fd, 10) == -1) {
+        fprintf(stderr, "replication: failed to listen on %s\n", port);
+        return -1;
+    }
+    run_id = ((uint64_t) time(NULL) << 20) ^ (uint64_t) getpid();
+    take_snapshot = snapshot;
+    primary = 1;
+    pthread_t t;
+    if (pthread_create(&t, NULL, &accept_fun, NULL) != 0) {
+        printf("Thread error\n");
+        return -1;
+    }
+    pthread_detach(t);
+    printf("replication: primary, followers connect to port %s\n", port);
+    return 0;
+}
+
+static int connect_primary(void) {
+    struct addrinfo hints, *servinfo, *p;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(primary_host, primary_port, &hints, &servinfo) != 0)
+        return -1;
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+// applies one frame from the primary, -1 if it is malformed
+static int follow_frame(char type, Buf *in, uint64_t *run, unsigned long *applied) {
+    const char *p = in->data, *end = in->data + in->len;
+    char str[1024];
+    if (type == F_SNAPSHOT) {
+        if (in->len < 20)
+            return -1;
+        uint64_t new_run = get_u64(p);
+        unsigned long lsn = get_u64(p + 8);
+        uint32_t count = get_u32(p + 16);
+        p += 20;
+        apply(0, NULL, 1);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (end - p < 2)
+                return -1;
+            uint16_t len = get_u16(p);
+            if (len > 1023 || end - p - 2 < len)
+                return -1;
+            memcpy(str, p + 2, len);
+            str[len] = '\0';
+            apply(REPL_PUSH, str, 0);
+            p += 2 + len;
+        }
+        *run = new_run;
+        *applied = lsn;
+        printf("replication: loaded snapshot of %u items at lsn %lu\n", count, lsn);
+        return 0;
+    }
+    if (type != F_BATCH || in->len < 4)
+        return -1;
+    uint32_t count = get_u32(p);
+    p += 4;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (end - p < 11)
+            return -1;
+        unsigned long lsn = get_u64(p);
+        char op = p[8];
+        uint16_t len = get_u16(p + 9);
+        if (len > 1023 || end - p - 11 < len)
+            return -1;
+        memcpy(str, p + 11, len);
+        str[len] = '\0';
+        p += 11 + len;
+        if (lsn <= *applied)
+            continue; // already applied
+        if (lsn != *applied + 1) { // lost mutations, reconnect to catch up from *applied
+            printf("replication: gap, got lsn %lu after %lu\n", lsn, *applied);
+            return -1;
+        }
+        apply(op, str, 0);
+        *applied = lsn;
+    }
+    return 0;
+}
+
+static void *follow_fun(void *arg) {
+    (void) arg;
+    uint64_t run = 0;
+    unsigned long applied = 0;
+    Buf in = {NULL, 0, 0}, out = {NULL, 0, 0};
+    char type;
+    while (1) {
+        int fd = connect_primary();
+        if (fd == -1) {
+            sleep(1);
+            continue;
+        }
+        printf("replication: following %s:%s from lsn %lu\n", primary_host, primary_port, applied);
+        frame_begin(&out, F_HELLO);
+        put_u64(&out, run);
+        put_u64(&out, applied);
+        frame_end(&out);
+        if (send_all(fd, out.data, out.len) == 0) {
+            while (read_frame(fd, &type, &in) == 0) {
+                if (follow_frame(type, &in, &run, &applied) == -1)
+                    break;
+                frame_begin(&out, F_ACK); // cumulative, the primary keeps sending meanwhile
+                put_u64(&out, applied);
+                frame_end(&out);
+                if (send_all(fd, out.data, out.len) == -1)
+                    break;
+            }
+        }
+        close(fd);
+        printf("replication: lost the primary, reconnecting\n");
+        sleep(1);
+    }
+    return NULL;
+}
+
+int repl_follow(const char *hostport, repl_apply fn) {
+    const char *colon = strrchr(hostport, ':');
+    if (colon == NULL || colon == hostport || (size_t) (colon - hostport) >= sizeof primary_host
+        || strlen(colon + 1) >= sizeof primary_port) {
+        fprintf(stderr, "replication: expected host:port, got '%s'\n", hostport);
+        return -1;
+    }
+    memcpy(primary_host, hostport, colon - hostport);
+    primary_host[colon - hostport] = '\0';
+    strcpy(primary_port, colon + 1);
+    apply = fn;
+    follower = 1;
+    pthread_t t;
+    if (pthread_create(&t, NULL, &follow_fun, NULL) != 0) {
+        printf("Thread error\n");
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+** replication.h -- ships the PUSH/POP log of a primary to hot standby followers
+*/
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#define REPL_LOG_SIZE 1024 // mutations kept for followers catching up (power of 2)
+
+#define REPL_BATCH 64      // max mutations per frame
+
+#define REPL_WINDOW 512    // max mutations sent but not acknowledged
+
+#define REPL_PUSH 'U'
+#define REPL_POP 'O'
+
+typedef void (*repl_emit)(void *ctx, const char *str);
+
+// primary: emit every item bottom to top, return the LSN of the last logged mutation
+typedef unsigned long (*repl_snapshot)(repl_emit emit, void *ctx);
+
+// follower: reset == 1 empties the stack before a snapshot is loaded
+typedef void (*repl_apply)(int op, const char *str, int reset);
+
+int repl_primary(const char *port, repl_snapshot snapshot);
+int repl_follow(const char *hostport, repl_apply apply);
+void repl_log(int op, const char *str); // primary: call with the stack locked
+unsigned long repl_lsn(void);           // primary: LSN of the last mutation
+int repl_is_follower(void);
+
+#endif
@@ -2,6 +2,7 @@
 ** server.c -- a stream socket server demo
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -17,18 +18,44 @@
 #include <pthread.h>
 #include <malloc.h>
 #include "synchronization.h"
-#include "myMalloc.c"
+#include "trace.h"
+#include "shardstack.h"
+#include "topology.h"
+#include "replication.h"
+#include "epoch.h"
+#include "timerwheel.h"
+#include "lockprof.h"
+#include "myMalloc.h"
+#include "parser.h"
+#include "tier.h"
 
 
 
-#define PORT "3490"  // the port users will be connecting to
+#define PORT "3490"  // the default port users will be connecting to
 
 #define BACKLOG 10     // how many pending connections queue will hold
 
-#define NUM_CLIENTS 10 // max of clients
+#define NUM_CLIENTS 10 // default max of clients
 
-pStack head = NULL; // Stack
-pthread_mutex_t mutex;
+#define WORKER_STACK (256 * 1024) // stack of a connection thread, one thread per connection (see README for the limits)
+
+pStack head = NULL; // Stack, written under mutex, read without it (see epoch.c)
+ProfLock mutex;
+int relaxed = 0; // -k: k-relaxed sharded stack instead of the single head
+int numa_arenas = 0; // -m: stack nodes come from the arena of the thread's node
+int tiered = 0;      // -T: the cold bottom of the stack is spilled to a file, no size limit
+
+pConn conns;          // connection pool
+int *free_slots;      // indexes of the unused connections
+int nfree = 0;
+pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+unsigned long idle_ms = 0;     // -i: close connections idle that long, 0 = never
+unsigned long deadline_ms = 0; // -d: close connections whose request takes longer, 0 = never
+
+pthread_mutex_t bpop_lock = PTHREAD_MUTEX_INITIALIZER; // BPOP waiters sleep on bpop_cond
+pthread_cond_t bpop_cond = PTHREAD_COND_INITIALIZER;
+int bpop_waiters = 0;
 
 void sigchld_handler(int s) {
     (void) s; // quiet unused variable warning
@@ -51,14 +78,15 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6 *) sa)->sin6_addr);
 }
 
-int count = 0;
+int count = 0; // resident items, written under mutex, read without it
+unsigned long spilled = 0;  // -T: items in the file, below the resident ones, same rules as count
+pStack marks[TIER_MARKS];   // -T: bottom node of each resident segment, by segment number
+unsigned long low_water;    // -T: lowest depth since the spill in progress was planned
 
-void push(char *str, pStack *head) {
-    pthread_mutex_lock(&mutex);
-    if (count == 1024) {
-        printf("ERROR: Stack full\n");
-        return;
-    }
+// callers hold mutex
+int push_locked(const char *str, pStack *head) {
+    if (count == (tiered ? (TIER_MARKS - 1) * TIER_SEG : STACK_SIZE)) // -T: the spill can't keep up
+        return -1;
 //    pStack node = (pStack)(malloc(sizeof(Stack)));
     pStack node = (pStack)(_malloc(sizeof(Stack)));
     if (node == NULL) {
@@ -68,46 +96,362 @@ void push(char *str, pStack *head) {
     bzero(node->stack, 1024);
     strcpy(node->stack, str); //input data
     node->next = *head;
-    *head = node;
-    printf("'%s' pushed to stack\n", str);
-    count++;
-    pthread_mutex_unlock(&mutex);
+    if (tiered && (spilled + count) % TIER_SEG == 0)
+        marks[(spilled + count) / TIER_SEG % TIER_MARKS] = node;
+    __atomic_store_n(head, node, __ATOMIC_RELEASE);
+    __atomic_store_n(&count, count + 1, __ATOMIC_RELAXED);
+    if (tiered && count == TIER_HIGH + 1)
+        tier_kick();
+    return 0;
 }
 
-void pop(pStack *head) {
-    pthread_mutex_lock(&mutex);
-    if (count == 0) {
-        printf("ERROR: Stack empty\n");
-        return;
+// callers hold mutex: links the paged in segment seg under the resident items
+void attach_locked(unsigned long seg, pStack top, pStack bottom, pStack *head) {
+    if (count == 0)
+        __atomic_store_n(head, top, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&marks[(seg + 1) % TIER_MARKS]->next, top, __ATOMIC_RELEASE);
+    marks[seg % TIER_MARKS] = bottom;
+    __atomic_store_n(&count, count + TIER_SEG, __ATOMIC_RELAXED);
+    __atomic_store_n(&spilled, spilled - TIER_SEG, __ATOMIC_RELEASE);
+}
+
+// -T, called without mutex: reads segment seg and links it in, unless someone
+// else did it meanwhile; 0 if it could not be read
+int page_in(unsigned long seg, pStack *head) {
+    pStack top, bottom;
+    if ((top = tier_read(seg, &bottom)) == NULL)
+        return 0;
+    if (seg > 0)
+        tier_prefetch(seg - 1); // pops will get there next
+    prof_lock(&mutex);
+    if (spilled == (seg + 1) * TIER_SEG) {
+        attach_locked(seg, top, bottom, head);
+        top = NULL;
+    }
+    prof_unlock(&mutex);
+    while (top != NULL) { // read twice, never published
+        pStack next = top->next;
+        _free(top);
+        top = next;
     }
+    return 1;
+}
+
+// callers hold mutex, out may be NULL
+int pop_locked(char *out, pStack *head) {
+    if (count == 0)
+        return 0;
     pStack tmp = *head;
-    *head = (*head)->next;
-    printf("'%s' poped\n", tmp->stack);
+    __atomic_store_n(head, tmp->next, __ATOMIC_RELEASE);
+    if (out)
+        strcpy(out, tmp->stack);
 //    free(tmp);
-    _free(tmp);
-    count--;
-    pthread_mutex_unlock(&mutex);
+    epoch_retire(tmp); // readers may still hold it
+    __atomic_store_n(&count, count - 1, __ATOMIC_RELAXED);
+    if (tiered) {
+        if (spilled + count < low_water)
+            low_water = spilled + count;
+        if (count == TIER_LOW - 1 && spilled)
+            tier_kick();
+    }
+    return 1;
+}
+
+// -T, run by the tier thread: spills the bottom segment above TIER_HIGH resident
+// items, pages the next one in below TIER_LOW; the file is accessed unlocked
+int tier_step(void) {
+    prof_op(PROF_OTHER);
+    prof_lock(&mutex);
+    if (count > TIER_HIGH) {
+        unsigned long seg = spilled / TIER_SEG;
+        pStack above = marks[(seg + 1) % TIER_MARKS], top = above->next;
+        low_water = spilled + count;
+        prof_unlock(&mutex);
+        epoch_enter(); // pops may retire the segment meanwhile
+        int rv = tier_write(seg, top);
+        epoch_exit();
+        if (rv == -1)
+            return 0;
+        prof_lock(&mutex);
+        if (low_water <= (seg + 1) * TIER_SEG) { // popped into it, the copy is stale
+            prof_unlock(&mutex);
+            return 1;
+        }
+        __atomic_store_n(&above->next, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&spilled, spilled + TIER_SEG, __ATOMIC_RELEASE); // see spilled_item
+        __atomic_store_n(&count, count - TIER_SEG, __ATOMIC_RELAXED);
+        prof_unlock(&mutex);
+        for (int i = 0; i < TIER_SEG; ++i) {
+            pStack next = top->next;
+            epoch_retire(top);
+            top = next;
+        }
+        return 1;
+    }
+    if (count < TIER_LOW && spilled) {
+        unsigned long seg = spilled / TIER_SEG - 1;
+        prof_unlock(&mutex);
+        return page_in(seg, &head);
+    }
+    prof_unlock(&mutex);
+    return 0;
+}
+
+void wake_waiters(void) {
+    pthread_mutex_lock(&bpop_lock);
+    pthread_cond_broadcast(&bpop_cond);
+    pthread_mutex_unlock(&bpop_lock);
+}
+
+void push(char *str, pStack *head) {
+    if (relaxed) {
+        if (shard_push(str) == -1) {
+            printf("ERROR: Stack full\n");
+            return;
+        }
+        if (__atomic_load_n(&bpop_waiters, __ATOMIC_SEQ_CST))
+            wake_waiters();
+        printf("'%s' pushed to stack\n", str);
+        return;
+    }
+    if (repl_is_follower()) {
+        printf("ERROR: read-only follower\n");
+        return;
+    }
+    prof_lock(&mutex);
+    if (push_locked(str, head) == -1) {
+        prof_unlock(&mutex);
+        printf("ERROR: Stack full\n");
+        return;
+    }
+    repl_log(REPL_PUSH, str);
+    prof_unlock(&mutex);
+    if (__atomic_load_n(&bpop_waiters, __ATOMIC_SEQ_CST))
+        wake_waiters();
+    printf("'%s' pushed to stack\n", str);
+}
+
+// 1 and the item in str, 0 when empty, -1 on a follower
+int pop_item(char *str, pStack *head) {
+    if (relaxed)
+        return shard_pop(str);
+    if (repl_is_follower())
+        return -1;
+    prof_lock(&mutex);
+    while (tiered && count == 0 && spilled) { // the pops outran the prefetch: wait for the disk, not with the mutex
+        unsigned long seg = spilled / TIER_SEG - 1;
+        prof_unlock(&mutex);
+        if (!page_in(seg, head))
+            return 0;
+        prof_lock(&mutex);
+    }
+    if (!pop_locked(str, head)) {
+        prof_unlock(&mutex);
+        return 0;
+    }
+    repl_log(REPL_POP, NULL);
+    prof_unlock(&mutex);
+    return 1;
+}
+
+void print_pop(int rv, char *str) {
+    if (rv == 1)
+        printf("'%s' poped\n", str);
+    else if (rv == 0)
+        printf("ERROR: Stack empty\n");
+    else
+        printf("ERROR: read-only follower\n");
+}
+
+void pop(pStack *head) {
+    char str[1024];
+    print_pop(pop_item(str, head), str);
+}
+
+// pop, waiting up to ms for a push when the stack is empty
+void bpop(pConn conn, int ms, pStack *head) {
+    char str[1024];
+    int rv = pop_item(str, head);
+    if (rv == 0 && ms > 0) {
+        __atomic_store_n(&conn->op_expired, 0, __ATOMIC_RELAXED);
+        tw_add(&conn->op, ms);
+        pthread_mutex_lock(&bpop_lock);
+        __atomic_add_fetch(&bpop_waiters, 1, __ATOMIC_SEQ_CST); // before looking, so no push is missed
+        while ((rv = pop_item(str, head)) == 0 && !__atomic_load_n(&conn->op_expired, __ATOMIC_RELAXED)
+               && !__atomic_load_n(&conn->expired, __ATOMIC_RELAXED))
+            pthread_cond_wait(&bpop_cond, &bpop_lock);
+        __atomic_sub_fetch(&bpop_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&bpop_lock);
+        tw_del(&conn->op);
+        __atomic_store_n(&conn->last_active, tw_now(), __ATOMIC_RELAXED); // idle from now on
+    }
+    print_pop(rv, str);
+}
+
+// -T, when the pops drained the resident items before the next segment was
+// paged in: the k-th newest spilled item, read from the file without a lock
+int spilled_item(unsigned long k, char *out) {
+    unsigned long n;
+    do {
+        if (k >= (n = __atomic_load_n(&spilled, __ATOMIC_ACQUIRE)))
+            return 0;
+    } while (!tier_item(n - 1 - k, out));
+    return 1;
 }
 
 void top(pStack *head) {
-    pthread_mutex_lock(&mutex);
-    if (count == 0) {
+    if (relaxed) {
+        char str[1024];
+        if (shard_top(str))
+            printf("OUTPUT: %s\n", str);
+        else
+            printf("ERROR: Stack empty\n");
+        return;
+    }
+    char str[1024];
+    epoch_enter(); // never waits for the writers
+    pStack node = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    if (node)
+        strcpy(str, node->stack);
+    epoch_exit();
+    if (node == NULL && !(tiered && spilled_item(0, str))) {
         printf("ERROR: Stack empty\n");
         return;
     }
     printf("OUTPUT: ");
-    printf("%s\n", (*head)->stack);
-    pthread_mutex_unlock(&mutex);
+    printf("%s\n", str);
 }
 
-int checkSUB(char e[], char s[]) {
-    if (strlen(s) < strlen(e))
-        return 0;
-    for (int i = 0; i < strlen(e); ++i) {
-        if (s[i] != e[i])
-            return 0;
+void depth(void) {
+    if (relaxed)
+        printf("OUTPUT: %d\n", shard_depth());
+    else
+        printf("OUTPUT: %lu\n", __atomic_load_n(&spilled, __ATOMIC_RELAXED) + __atomic_load_n(&count, __ATOMIC_RELAXED));
+}
+
+void print_item(const char *str) {
+    printf("OUTPUT: %s\n", str);
+}
+
+// the n most recent items, newest first
+void peek(int n, pStack *head) {
+    int found = 0;
+    if (relaxed) {
+        found = shard_peek(n, print_item);
+    } else {
+        epoch_enter();
+        pStack p = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+        for (; p != NULL && found < n; p = p->next, found++)
+            print_item(p->stack);
+        epoch_exit();
+        char str[1024];
+        while (tiered && p == NULL && found == 0) // nothing resident, -T: from the file
+            for (; found < n && spilled_item(found, str); found++)
+                print_item(str);
     }
-    return 1;
+    if (found == 0)
+        printf("ERROR: Stack empty\n");
+}
+
+// primary: the whole stack bottom to top, consistent with the log position returned
+unsigned long snapshot_stack(repl_emit emit, void *ctx) {
+    pStack items[STACK_SIZE];
+    int n = 0;
+    prof_lock(&mutex);
+    unsigned long lsn = repl_lsn();
+    for (pStack p = head; p != NULL && n < STACK_SIZE; p = p->next)
+        items[n++] = p;
+    while (n > 0)
+        emit(ctx, items[--n]->stack);
+    prof_unlock(&mutex);
+    return lsn;
+}
+
+// follower: mutations shipped by the primary
+void apply_replicated(int op, const char *str, int reset) {
+    prof_lock(&mutex);
+    if (reset) {
+        while (pop_locked(NULL, &head));
+    } else if (op == REPL_PUSH) {
+        if (push_locked(str, &head) == -1)
+            printf("ERROR: Stack full\n");
+    } else if (op == REPL_POP) {
+        pop_locked(NULL, &head);
+    }
+    prof_unlock(&mutex);
+}
+
+// timer callbacks, run by the wheel thread
+
+unsigned long idle_expired(void *arg) {
+    pConn conn = (pConn) arg;
+    if (conn->op.next != NULL) // waiting in BPOP is not idle, look again idle_ms after it ends
+        return (conn->op.expires - tw_now()) * TW_TICK_MS + idle_ms; // we hold the wheel lock
+    unsigned long idle = (tw_now() - __atomic_load_n(&conn->last_active, __ATOMIC_RELAXED)) * TW_TICK_MS;
+    if (idle < idle_ms) // there was a request meanwhile, check again later
+        return idle_ms - idle;
+    __atomic_store_n(&conn->expired, TIMEOUT_IDLE, __ATOMIC_RELAXED);
+    shutdown(conn->fd, SHUT_RDWR); // the blocked recv returns at once
+    wake_waiters();
+    return 0;
+}
+
+unsigned long deadline_expired(void *arg) {
+    pConn conn = (pConn) arg;
+    __atomic_store_n(&conn->expired, TIMEOUT_DEADLINE, __ATOMIC_RELAXED);
+    shutdown(conn->fd, SHUT_RDWR);
+    wake_waiters();
+    return 0;
+}
+
+unsigned long op_expired(void *arg) {
+    pConn conn = (pConn) arg;
+    __atomic_store_n(&conn->op_expired, 1, __ATOMIC_RELAXED);
+    wake_waiters();
+    return 0;
+}
+
+// waits until a connection slot is free
+pConn get_slot(void) {
+    pthread_mutex_lock(&slot_lock);
+    while (nfree == 0)
+        pthread_cond_wait(&slot_cond, &slot_lock);
+    pConn conn = &conns[free_slots[--nfree]];
+    pthread_mutex_unlock(&slot_lock);
+    return conn;
+}
+
+void put_slot(pConn conn) {
+    pthread_mutex_lock(&slot_lock);
+    free_slots[nfree++] = conn->slot;
+    pthread_cond_signal(&slot_cond);
+    pthread_mutex_unlock(&slot_lock);
+}
+
+void end_conn(pConn conn) {
+    tw_del(&conn->idle); // no timer can touch the fd after this
+    tw_del(&conn->deadline);
+    tw_del(&conn->op);
+    close(conn->fd);
+    put_slot(conn);
+}
+
+// prints the lock profile on every SIGUSR1, closes the trace and exits on SIGINT/SIGTERM
+void *signal_fun(void *arg) {
+    sigset_t *set = (sigset_t *) arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+        if (sig == SIGUSR1) {
+            prof_report(stdout);
+            continue;
+        }
+        trace_close(); // flushes the records still in the ring
+        printf("server: exiting\n");
+        fflush(stdout);
+        exit(0);
+    }
+    return NULL;
 }
 
 void *myThreadFun(void *arg) {
@@ -116,12 +460,20 @@ void *myThreadFun(void *arg) {
         perror("send");
     close(new_fd);
     printf("server: end connection\n");*/
-    int new_fd = *(int *) arg;
-    char text[1024];
+    pConn conn = (pConn) arg;
+    int new_fd = conn->fd;
+    unsigned int conn_id = conn->id;
+    if (numa_arenas)
+        malloc_set_node(conn->node >= 0 ? conn->node : topo_cpu_node(sched_getcpu()));
+    conn->last_active = tw_now();
+    if (idle_ms)
+        tw_add(&conn->idle, idle_ms);
+    Parser *in = &conn->in;
+    parser_init(in);
+    int in_request = 0; // the deadline runs from the first byte of a request
     while (1) {
-        char str[1024];
-        bzero(str, 1024);
-        bzero(text, 1024);
+        size_t room;
+        char *text = parser_space(in, &room);
         int msglen;
 /*        for (int i = 0; i < 1024; i++) {
             if (text[i - 1] == '\n') {
@@ -130,38 +482,83 @@ void *myThreadFun(void *arg) {
             }
             scanf("%c", &text[i]);
         }*/
-        if ((msglen = recv(new_fd, text, 1024 - 1, 0)) == -1) {
-            perror("recv error");
-            exit(1);
+        if ((msglen = recv(new_fd, text, room, 0)) <= 0) {
+            int expired = __atomic_load_n(&conn->expired, __ATOMIC_RELAXED);
+            if (expired == TIMEOUT_IDLE)
+                printf("Client idle, disconnected\n");
+            else if (expired == TIMEOUT_DEADLINE)
+                printf("Request deadline exceeded, disconnected\n");
+            else if (msglen == -1)
+                perror("recv error");
+            else
+                printf("Client disconnect\n");
+            break;
         }
-        if (!msglen) {
-            printf("Client disconnect\n");
-            close(new_fd);
-            return NULL;
+        parser_filled(in, msglen);
+        __atomic_store_n(&conn->last_active, tw_now(), __ATOMIC_RELAXED);
+        if (deadline_ms && !in_request)
+            tw_add(&conn->deadline, deadline_ms);
+        in_request = 1;
+        trace_record(conn_id, text, msglen);
+        // every complete command of this recv, a partial one stays buffered
+        Command cmd;
+        int rv, stop = 0;
+        while (!stop && !__atomic_load_n(&conn->expired, __ATOMIC_RELAXED)
+               && (rv = parser_next(in, &cmd)) != 0) {
+            if (rv == -1) {
+                printf("ERROR: Command too long\n");
+                continue;
+            }
+            printf("Received: '%s'\n", cmd.line);
+            switch (cmd.op) {
+                case CMD_STOP:
+                    printf("See Ya");
+                    stop = 1;
+                    break;
+                case CMD_PUSH:
+                    prof_op(PROF_PUSH);
+                    push(cmd.arg, &head);
+                    break;
+                case CMD_POP:
+                    prof_op(PROF_POP);
+                    pop(&head);
+                    break;
+                case CMD_BPOP: // BPOP ms
+                    prof_op(PROF_POP);
+                    bpop(conn, atoi(cmd.arg), &head);
+                    break;
+                case CMD_TOP:
+                    prof_op(PROF_TOP);
+                    top(&head);
+                    break;
+                case CMD_DEPTH:
+                    prof_op(PROF_TOP);
+                    depth();
+                    break;
+                case CMD_PEEK: // PEEK n
+                    prof_op(PROF_TOP);
+                    peek(cmd.arg[0] ? atoi(cmd.arg) : 1, &head);
+                    break;
+            }
+            prof_op(PROF_OTHER);
         }
-        text[msglen] = '\0';
-        printf("Received: '%s'\n", text);
-        if (checkSUB("STOP", text)) {
-            printf("See Ya");
-            close(new_fd);
+        if (stop)
             break;
-        } else if (checkSUB("PUSH ", text)) {
-            for (int i = 5; i < strlen(text); ++i) {
-                str[i - 5] = text[i];
-            }
-            push(str, &head);
-        } //POP
-        else if (checkSUB("POP", text)) {
-            pop(&head);
-        } //TOP
-        else if (checkSUB("TOP", text)) {
-            top(&head);
-        } //STOP
+        if (__atomic_load_n(&conn->expired, __ATOMIC_RELAXED) == TIMEOUT_DEADLINE) {
+            printf("Request deadline exceeded, disconnected\n");
+            break;
+        }
+        if (deadline_ms && !parser_pending(in)) {
+            tw_del(&conn->deadline);
+            in_request = 0;
+        }
     }
+    end_conn(conn);
+    return NULL;
 }
 
 
-int main(void) {
+int main(int argc, char *argv[]) {
     int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
     struct addrinfo hints, *servinfo, *p;
     struct sockaddr_storage their_addr; // connector's address information
@@ -170,13 +567,159 @@ int main(void) {
     int yes = 1;
     char s[INET6_ADDRSTRLEN];
     int rv;
+    int opt;
+    unsigned int conn_id = 0;
+    unsigned long relax = 0;
+    int nshards = -1; // -n, one per cpu by default
+    int pin = PIN_NONE;
+    int max_clients = NUM_CLIENTS;
+    static sigset_t sig_set;
+
+    // these are only taken by signal_fun, so block them before any thread starts
+    sigemptyset(&sig_set);
+    sigaddset(&sig_set, SIGUSR1);
+    sigaddset(&sig_set, SIGINT);
+    sigaddset(&sig_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+    const char *port = PORT;
+    const char *repl_port = NULL, *primary = NULL;
+    const char *tier_path = NULL;
+
+    while ((opt = getopt(argc, argv, "p:r:k:n:a:mR:f:c:i:d:L:T:")) != -1) {
+        switch (opt) {
+            case 'p': // port for clients
+                port = optarg;
+                break;
+            case 'R': // primary: followers connect to this port
+                repl_port = optarg;
+                break;
+            case 'f': // follower of the primary at host:port
+                primary = optarg;
+                break;
+            case 'r': // record incoming commands to a trace file
+                if (trace_open(optarg) == -1)
+                    exit(1);
+                break;
+            case 'k': // pops may return any of the k+1 most recent items
+                relaxed = 1;
+                relax = strtoul(optarg, NULL, 10);
+                break;
+            case 'n': // number of shards of the relaxed stack
+                nshards = atoi(optarg);
+                break;
+            case 'a': // pin worker threads: none, compact or scatter
+                if ((pin = topo_policy(optarg)) == -1) {
+                    fprintf(stderr, "server: unknown pinning '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'm': // NUMA-local allocation arenas
+                numa_arenas = 1;
+                break;
+            case 'c': // max of clients
+                max_clients = atoi(optarg);
+                break;
+            case 'i': // idle timeout, seconds
+                idle_ms = strtoul(optarg, NULL, 10) * 1000;
+                break;
+            case 'd': // request deadline, ms
+                deadline_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'T': // unbounded stack, cold segments spilled to this file
+                tier_path = optarg;
+                break;
+            case 'L': // lock profiling, time 1 in n acquisitions
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "server: -L needs a sample rate of 1 or more\n");
+                    exit(1);
+                }
+                prof_enable((unsigned int) atoi(optarg));
+                break;
+            default:
+                fprintf(stderr, "usage: server [-p port] [-r tracefile] [-k relaxation [-n shards]] "
+                                "[-a none|compact|scatter] [-m] [-R replport | -f host:replport] "
+                                "[-c clients] [-i idle_sec] [-d deadline_ms] [-L sample] [-T spillfile]\n");
+                exit(1);
+        }
+    }
+    if (topo_init(pin) == -1)
+        exit(1);
+    topo_report();
+    printf("parser: %s command scan\n", parser_isa());
+    if (numa_arenas) {
+        int ids[MAX_NODES];
+        for (int i = 0; i < topo_nodes(); ++i)
+            ids[i] = topo_node_id(i);
+        if (malloc_init_nodes(topo_nodes(), ids) == -1) {
+            fprintf(stderr, "server: failed to set up NUMA arenas\n");
+            exit(1);
+        }
+        printf("server: one allocation arena per NUMA node\n");
+    }
+    if (nshards == -1 && (nshards = (int) sysconf(_SC_NPROCESSORS_ONLN)) > MAX_SHARDS)
+        nshards = MAX_SHARDS; // only the default is capped, -n 100 is an error
+    if (relaxed) {
+        if (shard_init(nshards, relax) == -1) {
+            fprintf(stderr, "server: shards must be 1..%d\n", MAX_SHARDS);
+            exit(1);
+        }
+        printf("server: relaxed stack, %d shards, k = %lu\n", nshards, relax);
+    }
+    prof_init(&mutex, "stack");
+    if (max_clients < 1) {
+        fprintf(stderr, "server: need at least one client\n");
+        exit(1);
+    }
+    conns = (pConn) calloc(max_clients, sizeof(Conn));
+    free_slots = (int *) malloc(max_clients * sizeof(int));
+    if (conns == NULL || free_slots == NULL) {
+        perror("Malloc failed");
+        exit(1);
+    }
+    for (int i = 0; i < max_clients; ++i) {
+        conns[i].slot = i;
+        tw_init(&conns[i].idle, idle_expired, &conns[i]);
+        tw_init(&conns[i].deadline, deadline_expired, &conns[i]);
+        tw_init(&conns[i].op, op_expired, &conns[i]);
+        free_slots[nfree++] = max_clients - 1 - i;
+    }
+    if (tw_start() == -1)
+        exit(1);
+    pthread_t sig_thread;
+    if (pthread_create(&sig_thread, NULL, &signal_fun, &sig_set) != 0) {
+        printf("Thread error\n");
+        exit(1);
+    }
+    pthread_detach(sig_thread);
+    if ((repl_port || primary) && relaxed) {
+        fprintf(stderr, "server: replication needs the strict stack (no -k)\n");
+        exit(1);
+    }
+    if (tier_path && (relaxed || repl_port || primary)) {
+        fprintf(stderr, "server: -T needs the strict stack without replication (no -k, -R or -f)\n");
+        exit(1);
+    }
+    if (tier_path) {
+        if (tier_open(tier_path, tier_step) == -1)
+            exit(1);
+        tiered = 1;
+        printf("server: tiered stack, %d hot items resident, cold segments in %s\n", TIER_HIGH, tier_path);
+    }
+    if (repl_port && primary) {
+        fprintf(stderr, "server: -R and -f can't be used together\n");
+        exit(1);
+    }
+    if (repl_port && repl_primary(repl_port, snapshot_stack) == -1)
+        exit(1);
+    if (primary && repl_follow(primary, apply_replicated) == -1)
+        exit(1);
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; // use my IP
 
-    if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return 1;
     }
@@ -225,13 +768,13 @@ int main(void) {
     }
 
     printf("server: waiting for connections...\n");
-    int n = 0;
-    pthread_t thread[NUM_CLIENTS];
     while (1) {  // main accept() loop
+        pConn conn = get_slot(); // a timed out connection gives its slot back at once
         sin_size = sizeof their_addr;
         new_fd = accept(sockfd, (struct sockaddr *) &their_addr, &sin_size);
         if (new_fd == -1) {
             perror("accept");
+            put_slot(conn);
             continue;
         }
 
@@ -239,19 +782,22 @@ int main(void) {
                   get_in_addr((struct sockaddr *) &their_addr),
                   s, sizeof s);
         printf("server: got connection\n");
-        pthread_mutex_init(&mutex, NULL);
-        if (pthread_create(&thread[n++], NULL, &myThreadFun, &new_fd) != 0)
+        conn->fd = new_fd;
+        conn->id = conn_id++;
+        conn->expired = 0;
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_attr_setstacksize(&attr, WORKER_STACK);
+        conn->node = topo_place(&attr, conn->id);
+        if (pthread_create(&thread, &attr, &myThreadFun, conn) != 0) {
             printf("Thread error\n");
-//        n++;
-//        printf("Thread start\n");
-        if (n >= NUM_CLIENTS) {
-            n = 0;
-            while (n < NUM_CLIENTS) {
-                pthread_join(thread[n++], NULL); // equivalent of wait()
-            }
-            n = 0;
+            close(new_fd);
+            put_slot(conn);
         }
-        pthread_mutex_destroy(&mutex);
+        pthread_attr_destroy(&attr);
+//        printf("Thread start\n");
     }
 
     return 0;
@@ -0,0 +1,233 @@
+/*
+** shardstack.c -- k-relaxed stack made of per-core sub-stacks
+**
+** Each push goes to the sub-stack (shard) of the cpu the thread runs on.
+** A pop takes the local top as long as at most k items of the other shards
+** are newer, otherwise it steals the newest top of all the shards. So a pop
+** returns one of the k+1 most recent items, and only reports empty after
+** every shard was checked under its lock: an item is never lost.
+** Items are ordered by the monotonic clock read at push time, so a push
+** writes no shared cache line. Popped nodes go through the shard's own
+** limbo list (epoch.c) back to the shard's free list, without a global lock.
+** TOP, DEPTH and PEEK take no lock.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "synchronization.h"
+#include "shardstack.h"
+#include "myMalloc.h"
+#include "epoch.h"
+#include "lockprof.h"
+
+typedef struct Shard {
+    ProfLock lock;
+    pStack head;           // written under the lock, read without it
+    int count;             // written under the lock, read without it
+    int cap;               // its share of STACK_SIZE
+    unsigned long top_seq; // seq of head, 0 when empty; read without the lock
+    unsigned long last_seq;
+    pStack free;           // nodes to reuse, linked through next
+    Limbo limbo;           // popped nodes readers may still see
+} __attribute__((aligned(64))) Shard;
+
+static Shard shards[MAX_SHARDS];
+static char shard_name[MAX_SHARDS][16];
+static int num_shards = 1;
+static unsigned long relax = 0;
+
+int shard_init(int nshards, unsigned long k) {
+    if (nshards < 1 || nshards > MAX_SHARDS)
+        return -1;
+    num_shards = nshards;
+    relax = k;
+    for (int i = 0; i < num_shards; ++i) {
+        sprintf(shard_name[i], "shard %d", i);
+        prof_init(&shards[i].lock, shard_name[i]);
+        shards[i].head = NULL;
+        shards[i].count = 0;
+        shards[i].cap = STACK_SIZE / nshards + (i < STACK_SIZE % nshards); // adds up to STACK_SIZE
+        shards[i].top_seq = 0;
+        shards[i].last_seq = 0;
+        shards[i].free = NULL;
+        memset(&shards[i].limbo, 0, sizeof(Limbo));
+    }
+    return 0;
+}
+
+static int local_shard(void) {
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu % num_shards;
+}
+
+// push order: ns of the push, unique and increasing within a shard; caller holds s->lock
+static unsigned long next_seq(Shard *s) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long seq = (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    if (seq <= s->last_seq)
+        seq = s->last_seq + 1;
+    return s->last_seq = seq;
+}
+
+// caller holds s->lock and s->head != NULL
+static void take(Shard *s, char *out) {
+    pStack node = s->head;
+    __atomic_store_n(&s->head, node->next, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->top_seq, node->next ? node->next->seq : 0, __ATOMIC_RELEASE);
+    strcpy(out, node->stack);
+    pStack ready = epoch_retire_to(&s->limbo, node); // readers may still hold it
+    while (ready != NULL) {
+        pStack next = ready->limbo;
+        ready->next = s->free;
+        s->free = ready;
+        ready = next;
+    }
+}
+
+// items of the other shards newer than seq, counted up to k + 1; caller is in a read section
+static unsigned long newer_items(int self, unsigned long seq) {
+    unsigned long n = 0;
+    for (int i = 0; i < num_shards && n <= relax; ++i) {
+        if (i == self || __atomic_load_n(&shards[i].top_seq, __ATOMIC_ACQUIRE) <= seq)
+            continue;
+        for (pStack p = __atomic_load_n(&shards[i].head, __ATOMIC_ACQUIRE);
+             p != NULL && p->seq > seq && n <= relax; p = p->next)
+            n++;
+    }
+    return n;
+}
+
+// the shard whose top is the most recent, -1 if all look empty
+static int newest_shard(void) {
+    int best = -1;
+    unsigned long best_seq = 0;
+    for (int i = 0; i < num_shards; ++i) {
+        unsigned long seq = __atomic_load_n(&shards[i].top_seq, __ATOMIC_ACQUIRE);
+        if (seq > best_seq) {
+            best_seq = seq;
+            best = i;
+        }
+    }
+    return best;
+}
+
+int shard_push(const char *str) {
+    int first = local_shard();
+    for (int i = 0; i < num_shards; ++i) { // local shard first, spill over when it is full
+        Shard *s = &shards[(first + i) % num_shards];
+        prof_lock(&s->lock);
+        if (s->count < s->cap) {
+            pStack node = s->free;
+            if (node != NULL) {
+                s->free = node->next;
+            } else if ((node = (pStack) (_malloc(sizeof(Stack)))) == NULL) {
+                prof_unlock(&s->lock);
+                perror("Malloc failed");
+                return -1;
+            }
+            bzero(node->stack, 1024);
+            strcpy(node->stack, str); //input data
+            node->seq = next_seq(s);
+            node->next = s->head;
+            __atomic_store_n(&s->head, node, __ATOMIC_RELEASE);
+            __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->top_seq, node->seq, __ATOMIC_RELEASE);
+            prof_unlock(&s->lock);
+            return 0;
+        }
+        prof_unlock(&s->lock);
+    }
+    return -1;
+}
+
+int shard_pop(char *out) {
+    int self = local_shard();
+    Shard *s = &shards[self];
+    prof_lock(&s->lock);
+    if (s->head) {
+        epoch_enter();
+        unsigned long newer = newer_items(self, s->head->seq);
+        epoch_exit();
+        if (newer <= relax) {
+            take(s, out);
+            prof_unlock(&s->lock);
+            return 1;
+        }
+    }
+    prof_unlock(&s->lock);
+    while (1) { // steal the newest top
+        int best = newest_shard();
+        if (best == -1)
+            break;
+        s = &shards[best];
+        prof_lock(&s->lock);
+        if (s->head) {
+            take(s, out);
+            prof_unlock(&s->lock);
+            return 1;
+        }
+        prof_unlock(&s->lock); // emptied meanwhile, look again
+    }
+    for (int i = 0; i < num_shards; ++i) { // looked empty, make sure under the locks
+        s = &shards[i];
+        prof_lock(&s->lock);
+        if (s->head) {
+            take(s, out);
+            prof_unlock(&s->lock);
+            return 1;
+        }
+        prof_unlock(&s->lock);
+    }
+    return 0;
+}
+
+int shard_top(char *out) {
+    int found = 0;
+    epoch_enter();
+    while (!found) {
+        int best = newest_shard();
+        if (best == -1)
+            break;
+        pStack node = __atomic_load_n(&shards[best].head, __ATOMIC_ACQUIRE);
+        if (node) { // else emptied meanwhile, look again
+            strcpy(out, node->stack);
+            found = 1;
+        }
+    }
+    epoch_exit();
+    return found;
+}
+
+int shard_depth(void) {
+    int n = 0;
+    for (int i = 0; i < num_shards; ++i)
+        n += __atomic_load_n(&shards[i].count, __ATOMIC_RELAXED);
+    return n;
+}
+
+int shard_peek(int n, void (*emit)(const char *str)) {
+    pStack cursor[MAX_SHARDS];
+    int found = 0;
+    epoch_enter();
+    for (int i = 0; i < num_shards; ++i)
+        cursor[i] = __atomic_load_n(&shards[i].head, __ATOMIC_ACQUIRE);
+    while (found < n) { // merge the shards, most recent push first
+        int best = -1;
+        for (int i = 0; i < num_shards; ++i)
+            if (cursor[i] && (best == -1 || cursor[i]->seq > cursor[best]->seq))
+                best = i;
+        if (best == -1)
+            break;
+        emit(cursor[best]->stack);
+        cursor[best] = cursor[best]->next;
+        found++;
+    }
+    epoch_exit();
+    return found;
+}
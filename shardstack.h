@@ -0,0 +1,17 @@
+/*
+** shardstack.h -- k-relaxed stack made of per-core sub-stacks
+*/
+
+#ifndef SHARDSTACK_H
+#define SHARDSTACK_H
+
+#define MAX_SHARDS 64
+
+int shard_init(int nshards, unsigned long k);
+int shard_push(const char *str); // 0 on success, -1 when every shard is full
+int shard_pop(char *out);        // 1 and the item in out, 0 when empty
+int shard_top(char *out);        // 1 and the item in out, 0 when empty
+int shard_depth(void);
+int shard_peek(int n, void (*emit)(const char *str)); // the n most recent items, returns how many
+
+#endif
@@ -1,4 +1,35 @@
+#ifndef SYNCHRONIZATION_H
+#define SYNCHRONIZATION_H
+
+#include "timerwheel.h"
+#include "parser.h"
+
+#define STACK_SIZE 1024 // max items in the stack, shared by all the shards with -k
+
 typedef struct Stack {
     char stack[1024];
+    unsigned long seq; // push order, used by the relaxed stack
     struct Stack *next;
+    struct Stack *limbo;    // retired nodes waiting for the readers, see epoch.c
+    unsigned long retired;  // epoch the node was unlinked in
 } Stack, *pStack;
+
+#define TIMEOUT_IDLE 1
+#define TIMEOUT_DEADLINE 2
+
+// one slot of the connection pool, allocated once at startup
+typedef struct Conn {
+    int fd;
+    unsigned int id;           // connection number, used by the trace
+    int node;                  // NUMA node the thread is pinned to, -1 if not pinned
+    int slot;                  // index in the pool
+    int expired;               // TIMEOUT_IDLE or TIMEOUT_DEADLINE once a timer closed it
+    int op_expired;            // the blocking operation in progress timed out
+    unsigned long last_active; // tick of the last request, checked by the idle timer
+    Timer idle;
+    Timer deadline;            // armed while a request is processed
+    Timer op;                  // armed while a BPOP waits
+    Parser in;                 // received bytes not yet parsed
+} Conn, *pConn;
+
+#endif
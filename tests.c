@@ -0,0 +1,295 @@
+/*
+** tests.c -- checks of the parser, the timer wheel, the relaxed stack, the
+** epoch reclamation and the disk tier (make check)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "synchronization.h"
+#include "parser.h"
+#include "timerwheel.h"
+#include "shardstack.h"
+#include "epoch.h"
+#include "tier.h"
+#include "myMalloc.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static Parser p;
+
+// as if len bytes arrived, in recvs of at most the free room
+static void feed(const char *data, size_t len) {
+    while (len > 0) {
+        size_t room;
+        char *buf = parser_space(&p, &room);
+        size_t n = len < room ? len : room;
+        memcpy(buf, data, n);
+        parser_filled(&p, n);
+        data += n;
+        len -= n;
+        if (n == room) // full: let the test drain it like the server does
+            break;
+    }
+}
+
+#define FEED(lit) feed(lit, sizeof(lit) - 1)
+
+static void test_parser(void) {
+    Command cmd;
+
+    parser_init(&p);
+    FEED("PUSH sp"); // split over two recvs
+    CHECK(parser_next(&p, &cmd) == 0);
+    CHECK(parser_pending(&p));
+    FEED("lit\n");
+    CHECK(parser_next(&p, &cmd) == 1);
+    CHECK(cmd.op == CMD_PUSH && strcmp(cmd.arg, "split") == 0);
+    CHECK(parser_next(&p, &cmd) == 0);
+    CHECK(!parser_pending(&p));
+
+    FEED("TOP\r\nPOP\0DEPTH\0PEEK 3\nBPOP 250\nSTOP"); // CRLF, '\0' and pipelining
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_TOP && strcmp(cmd.line, "TOP") == 0);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_POP);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_DEPTH);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_PEEK && strcmp(cmd.arg, " 3") == 0);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_BPOP && strcmp(cmd.arg, " 250") == 0);
+    CHECK(parser_next(&p, &cmd) == 0); // STOP has no end yet
+    FEED("\n\n\r\n");                // empty lines are skipped
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_STOP);
+    CHECK(parser_next(&p, &cmd) == 0);
+
+    FEED("FOO\nPUSHX\nPOPX\nDEPTX\nPUSH \n"); // same prefixes as checkSUB accepted
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_NONE);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_NONE);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_POP);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_NONE);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_PUSH && cmd.arg[0] == '\0');
+
+    char big[3 * PARSE_BUF];
+    memset(big, 'x', sizeof big); // longer than the whole buffer
+    int too_long = 0, rv;
+    for (size_t off = 0; off < sizeof big; off += PARSE_BUF / 2) {
+        feed(big + off, PARSE_BUF / 2);
+        while ((rv = parser_next(&p, &cmd)) != 0)
+            too_long += rv == -1;
+    }
+    FEED("\nTOP\n");
+    while ((rv = parser_next(&p, &cmd)) == -1)
+        too_long++;
+    CHECK(too_long == 1);
+    CHECK(rv == 1 && cmd.op == CMD_TOP);
+
+    memset(big, 'y', PARSE_LINE_MAX + 1); // just over the limit, with its end in the same recv
+    big[PARSE_LINE_MAX + 1] = '\n';
+    feed(big, PARSE_LINE_MAX + 2);
+    FEED("POP\n");
+    CHECK(parser_next(&p, &cmd) == -1);
+    CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_POP);
+
+    for (int i = 0; i < 1000; ++i) { // the partial command moves to the front of the buffer
+        char line[32];
+        int n = sprintf(line, "PUSH item%d\n", i);
+        feed(line, n / 2);
+        feed(line + n / 2, n - n / 2);
+        CHECK(parser_next(&p, &cmd) == 1 && cmd.op == CMD_PUSH);
+        sprintf(line, "item%d", i);
+        CHECK(strcmp(cmd.arg, line) == 0);
+    }
+}
+
+static unsigned long fired_at[3];
+static int fired = 0;
+static int rearms = 0;
+
+static unsigned long once(void *arg) {
+    *(unsigned long *) arg = tw_now();
+    fired++;
+    return 0;
+}
+
+static unsigned long again(void *arg) {
+    (void) arg;
+    return ++rearms < 3 ? 50 : 0;
+}
+
+static void test_timerwheel(void) {
+    Timer near, far, cancelled, repeat;
+    CHECK(tw_start() == 0);
+    tw_init(&near, once, &fired_at[0]);
+    tw_init(&far, once, &fired_at[1]);   // beyond level 0, cascades down
+    tw_init(&cancelled, once, &fired_at[2]);
+    tw_init(&repeat, again, NULL);
+    unsigned long start = tw_now();
+    tw_add(&near, 100);
+    tw_add(&far, 900);
+    tw_add(&cancelled, 200);
+    tw_add(&repeat, 50);
+    CHECK(tw_del(&cancelled) == 1);
+    usleep(1200 * 1000);
+    CHECK(fired == 2);
+    CHECK(fired_at[0] - start >= 100 / TW_TICK_MS && fired_at[0] - start <= 100 / TW_TICK_MS + 2);
+    CHECK(fired_at[1] - start >= 900 / TW_TICK_MS && fired_at[1] - start <= 900 / TW_TICK_MS + 2);
+    CHECK(rearms == 3);
+    CHECK(tw_del(&near) == 0); // already fired
+    CHECK(tw_del(&repeat) == 0);
+}
+
+#define RELAX 4
+#define PUSHES (3 * STACK_SIZE)
+
+static char alive[PUSHES]; // pushed and not popped yet
+
+// pops one item, checks it was pushed, not popped before, and among the RELAX + 1 newest
+static int pop_checked(void) {
+    char str[1024];
+    if (!shard_pop(str))
+        return 0;
+    int i = atoi(str), newer = 0;
+    CHECK(i >= 0 && i < PUSHES && alive[i]);
+    if (i < 0 || i >= PUSHES)
+        return 1;
+    alive[i] = 0;
+    for (int j = i + 1; j < PUSHES; ++j)
+        newer += alive[j];
+    CHECK(newer <= RELAX);
+    return 1;
+}
+
+static void test_shardstack(void) {
+    char str[1024];
+    int next = 0, pushed = 0, left = 0;
+    CHECK(shard_init(3, RELAX) == 0); // STACK_SIZE doesn't divide by 3
+    for (; next < STACK_SIZE + 8; ++next) {
+        sprintf(str, "%d", next);
+        if (shard_push(str) == 0) {
+            alive[next] = 1;
+            pushed++;
+        }
+    }
+    CHECK(pushed == STACK_SIZE);
+    CHECK(shard_depth() == STACK_SIZE);
+    CHECK(shard_top(str) == 1 && atoi(str) == STACK_SIZE - 1);
+
+    for (int r = 0; r < 3 * STACK_SIZE; ++r) { // two pops for each push, then refill
+        if (r % 3 == 2 || r >= 2 * STACK_SIZE) {
+            sprintf(str, "%d", next);
+            if (shard_push(str) == 0)
+                alive[next] = 1;
+            next++;
+        } else {
+            CHECK(pop_checked());
+        }
+    }
+    while (pop_checked());
+    for (int i = 0; i < PUSHES; ++i)
+        left += alive[i];
+    CHECK(left == 0); // nothing lost
+    CHECK(shard_depth() == 0);
+    CHECK(shard_top(str) == 0);
+}
+
+static Stack retired[3 * EPOCH_BATCH];
+
+// nodes handed back by epoch_retire_to, checks they are all in [from, to)
+static int reusable(pStack ready, int from, int to) {
+    int n = 0;
+    for (; ready != NULL; ready = ready->limbo, n++)
+        CHECK(ready >= &retired[from] && ready < &retired[to]);
+    return n;
+}
+
+static void test_epoch(void) {
+    Limbo l = {NULL, 0, 0};
+    int back = 0;
+    epoch_enter(); // a reader that may still see the first batch
+    for (int i = 0; i < EPOCH_BATCH; ++i)
+        back += reusable(epoch_retire_to(&l, &retired[i]), 0, 0);
+    CHECK(back == 0);
+    epoch_exit();
+
+    epoch_enter(); // came after the first batch: holds only the second one
+    for (int i = EPOCH_BATCH; i < 2 * EPOCH_BATCH; ++i)
+        back += reusable(epoch_retire_to(&l, &retired[i]), 0, EPOCH_BATCH);
+    CHECK(back == EPOCH_BATCH);
+    CHECK(l.len == EPOCH_BATCH);
+    epoch_exit();
+
+    for (int i = 2 * EPOCH_BATCH; i < 3 * EPOCH_BATCH; ++i) // no reader left
+        back += reusable(epoch_retire_to(&l, &retired[i]), EPOCH_BATCH, 3 * EPOCH_BATCH);
+    CHECK(back == 3 * EPOCH_BATCH);
+    CHECK(l.len == 0 && l.head == NULL);
+}
+
+static int no_work(void) {
+    return 0;
+}
+
+static void test_tier(void) {
+    char path[] = "/tmp/tests-tier-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    if (fd == -1)
+        return;
+    close(fd);
+    CHECK(tier_open(path, no_work) == 0);
+
+    // spill 3 segments, as tier_step does: item i is the i-th push
+    for (int seg = 0; seg < 3; ++seg) {
+        pStack top = NULL;
+        for (int i = 0; i < TIER_SEG; ++i) {
+            pStack node = (pStack) _malloc(sizeof(Stack));
+            sprintf(node->stack, "item%d", seg * TIER_SEG + i);
+            node->next = top;
+            top = node;
+        }
+        CHECK(tier_write(seg, top) == 0);
+        while (top != NULL) {
+            pStack next = top->next;
+            _free(top);
+            top = next;
+        }
+    }
+
+    char str[1024], want[1024];
+    CHECK(tier_item(3 * TIER_SEG - 1, str) == 1 && strcmp(str, "item767") == 0);
+    CHECK(tier_item(0, str) == 1 && strcmp(str, "item0") == 0);
+
+    int next = 3 * TIER_SEG - 1; // page back in, newest segment first: pops see the pushes reversed
+    for (int seg = 2; seg >= 0; --seg) {
+        pStack bottom, p = tier_read(seg, &bottom), last = NULL;
+        CHECK(p != NULL);
+        while (p != NULL) {
+            sprintf(want, "item%d", next--);
+            CHECK(strcmp(p->stack, want) == 0);
+            last = p;
+            p = p->next;
+            _free(last);
+        }
+        CHECK(last == bottom);
+    }
+    CHECK(next == -1);
+    unlink(path);
+}
+
+int main(void) {
+    test_parser();
+    test_timerwheel();
+    test_shardstack();
+    test_epoch();
+    test_tier();
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed (parser: %s)\n", parser_isa());
+    return 0;
+}
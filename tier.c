@@ -0,0 +1,159 @@
+/*
+** tier.c -- spills the cold bottom of the stack to a memory-mapped file
+**
+** Items are stored in fixed TIER_ITEM slots, TIER_SEG of them per segment,
+** segment n at offset n * TIER_SEG * TIER_ITEM, oldest item first. The
+** whole file is mapped once in a TIER_MAP reservation and grown with
+** posix_fallocate, so a full disk is an error here instead of a SIGBUS on
+** a store. Spilled segments are synced and dropped from the page cache;
+** the segment below the one paged in is read ahead with MADV_WILLNEED.
+** Only the tier thread writes; it calls back into the server, which
+** decides what to move (see tier_step in server.c).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "tier.h"
+#include "myMalloc.h"
+
+#define SEG_BYTES ((unsigned long) TIER_SEG * TIER_ITEM)
+
+static int fd = -1;
+static char *map = NULL;
+static unsigned long file_segs = 0; // segments allocated in the file
+static tier_work work_fn = NULL;
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_cond = PTHREAD_COND_INITIALIZER;
+static int kicked = 0;
+static unsigned long writes = 0; // odd while tier_write copies a segment in, see tier_item
+static int grow_failed = 0;      // the last spill could not grow the file, said so already
+
+static void *tier_fun(void *arg) {
+    (void) arg;
+    while (1) {
+        while (work_fn());
+        pthread_mutex_lock(&tier_lock);
+        if (!kicked) { // look again now and then, a failed spill is retried
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&tier_cond, &tier_lock, &ts);
+        }
+        kicked = 0;
+        pthread_mutex_unlock(&tier_lock);
+    }
+    return NULL;
+}
+
+int tier_open(const char *path, tier_work work) {
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror("tier open");
+        return -1;
+    }
+    map = mmap(NULL, TIER_MAP, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("tier mmap");
+        close(fd);
+        return -1;
+    }
+    work_fn = work;
+    pthread_t t;
+    if (pthread_create(&t, NULL, &tier_fun, NULL) != 0) {
+        printf("Thread error\n");
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+void tier_kick(void) {
+    pthread_mutex_lock(&tier_lock);
+    kicked = 1;
+    pthread_cond_signal(&tier_cond);
+    pthread_mutex_unlock(&tier_lock);
+}
+
+int tier_write(unsigned long seg, pStack top) {
+    if (seg >= file_segs) {
+        unsigned long want = file_segs ? file_segs * 2 : 4;
+        while (want <= seg)
+            want *= 2;
+        if (want * SEG_BYTES > TIER_MAP)
+            want = TIER_MAP / SEG_BYTES;
+        int err = seg < want ? posix_fallocate(fd, 0, (off_t) (want * SEG_BYTES)) : ENOSPC;
+        if (err != 0) {
+            if (!grow_failed) // retried every 100ms, say it once
+                fprintf(stderr, "tier: can't grow the file: %s\n", strerror(err));
+            grow_failed = 1;
+            return -1;
+        }
+        if (grow_failed)
+            fprintf(stderr, "tier: the file grows again\n");
+        grow_failed = 0;
+        file_segs = want;
+    }
+    char *base = map + seg * SEG_BYTES;
+    pStack p = top;
+    __atomic_add_fetch(&writes, 1, __ATOMIC_ACQ_REL);
+    for (int i = TIER_SEG - 1; i >= 0; --i, p = p->next)
+        strcpy(base + (unsigned long) i * TIER_ITEM, p->stack);
+    __atomic_add_fetch(&writes, 1, __ATOMIC_RELEASE);
+    // it is cold: to disk now, out of RAM
+    msync(base, SEG_BYTES, MS_SYNC);
+    madvise(base, SEG_BYTES, MADV_DONTNEED);
+    posix_fadvise(fd, (off_t) (seg * SEG_BYTES), (off_t) SEG_BYTES, POSIX_FADV_DONTNEED);
+    return 0;
+}
+
+pStack tier_read(unsigned long seg, pStack *bottom) {
+    char *base = map + seg * SEG_BYTES;
+    pStack top = NULL;
+    *bottom = NULL;
+    for (int i = 0; i < TIER_SEG; ++i) {
+        pStack node = (pStack) (_malloc(sizeof(Stack)));
+        if (node == NULL) {
+            perror("Malloc failed");
+            while (top != NULL) {
+                pStack next = top->next;
+                _free(top);
+                top = next;
+            }
+            return NULL;
+        }
+        bzero(node->stack, 1024);
+        strcpy(node->stack, base + (unsigned long) i * TIER_ITEM);
+        node->next = top;
+        top = node;
+        if (i == 0)
+            *bottom = node;
+    }
+    madvise(base, SEG_BYTES, MADV_DONTNEED);
+    posix_fadvise(fd, (off_t) (seg * SEG_BYTES), (off_t) SEG_BYTES, POSIX_FADV_DONTNEED);
+    return top;
+}
+
+// a seqlock read: slots below the spilled count only change when a later
+// spill rewrites them, and then writes changes
+int tier_item(unsigned long index, char *out) {
+    unsigned long w = __atomic_load_n(&writes, __ATOMIC_ACQUIRE);
+    if (w & 1)
+        return 0;
+    memcpy(out, map + index * TIER_ITEM, TIER_ITEM);
+    out[TIER_ITEM - 1] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&writes, __ATOMIC_RELAXED) == w;
+}
+
+void tier_prefetch(unsigned long seg) {
+    madvise(map + seg * SEG_BYTES, SEG_BYTES, MADV_WILLNEED);
+}
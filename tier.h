@@ -0,0 +1,32 @@
+/*
+** tier.h -- spills the cold bottom of the stack to a memory-mapped file
+*/
+
+#ifndef TIER_H
+#define TIER_H
+
+#include "synchronization.h"
+
+#define TIER_SEG 256      // items moved to or from the file at once
+
+#define TIER_HIGH 1024    // more resident items than this: the bottom segment is spilled
+
+#define TIER_LOW 256      // fewer: the next segment is paged back in
+
+#define TIER_MARKS 64     // resident segments tracked, pushes fail beyond (TIER_MARKS - 1) segments
+
+#define TIER_ITEM 1024    // bytes per item in the file
+
+#define TIER_MAP (1UL << 36) // address space reserved for the file (64M items)
+
+typedef int (*tier_work)(void); // run by the tier thread until it returns 0
+
+int tier_open(const char *path, tier_work work);
+void tier_kick(void);                                // a watermark was crossed
+int tier_write(unsigned long seg, pStack top);       // the segment's items, top is the newest
+pStack tier_read(unsigned long seg, pStack *bottom); // new nodes, newest first, NULL on error
+void tier_prefetch(unsigned long seg);               // starts reading seg from disk
+int tier_item(unsigned long index, char *out);       // item index (0 = oldest) without a lock,
+                                                     // 0 when a spill raced with it: try again
+
+#endif
@@ -0,0 +1,136 @@
+/*
+** timerwheel.c -- hierarchical timing wheel for connection and request timeouts
+**
+** Level 0 has one slot per tick, level l one slot per 64^l ticks. A timer is
+** put in the lowest level whose range covers it (O(1)); when level 0 wraps
+** around, the next slot of level 1 is spread over level 0, and so on up.
+** One thread advances the wheel once per tick, so there is a single timed
+** sleep for all the timers together, and timers live inside the objects they
+** time, so there is no allocation either.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "timerwheel.h"
+#include "lockprof.h"
+
+static Timer wheel[TW_LEVELS][TW_SLOTS]; // list heads
+static unsigned long now_tick = 0;
+static ProfLock wheel_lock = PROF_LOCK_INITIALIZER("timer wheel");
+
+static void unlink_timer(pTimer t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+// caller holds wheel_lock
+static void place(pTimer t) {
+    unsigned long delta;
+    int level = 0;
+    if (t->expires < now_tick)
+        t->expires = now_tick;
+    delta = t->expires - now_tick;
+    while (level < TW_LEVELS - 1 && delta >= 1UL << (TW_BITS * (level + 1)))
+        level++;
+    if (delta >= 1UL << (TW_BITS * TW_LEVELS)) // too far away, wait as long as the wheel can
+        t->expires = now_tick + (1UL << (TW_BITS * TW_LEVELS)) - 1;
+    pTimer head = &wheel[level][(t->expires >> (TW_BITS * level)) & (TW_SLOTS - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+// caller holds wheel_lock: moves the timers of a higher level slot down
+static void cascade(int level, int slot) {
+    pTimer head = &wheel[level][slot];
+    while (head->next != head) {
+        pTimer t = head->next;
+        unlink_timer(t);
+        place(t);
+    }
+}
+
+// caller holds wheel_lock
+static void tick(void) {
+    __atomic_store_n(&now_tick, now_tick + 1, __ATOMIC_RELAXED); // tw_now() reads it without the lock
+    for (int level = 1; level < TW_LEVELS; ++level) {
+        if ((now_tick & ((1UL << (TW_BITS * level)) - 1)) != 0)
+            break;
+        cascade(level, (int) ((now_tick >> (TW_BITS * level)) & (TW_SLOTS - 1)));
+    }
+    pTimer head = &wheel[0][now_tick & (TW_SLOTS - 1)];
+    while (head->next != head) {
+        pTimer t = head->next;
+        unlink_timer(t);
+        unsigned long again = t->fn(t->arg);
+        if (again) {
+            t->expires = now_tick + (again + TW_TICK_MS - 1) / TW_TICK_MS;
+            place(t);
+        }
+    }
+}
+
+static void *wheel_fun(void *arg) {
+    (void) arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        next.tv_nsec += TW_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        prof_lock(&wheel_lock);
+        tick();
+        prof_unlock(&wheel_lock);
+    }
+    return NULL;
+}
+
+int tw_start(void) {
+    for (int level = 0; level < TW_LEVELS; ++level)
+        for (int slot = 0; slot < TW_SLOTS; ++slot)
+            wheel[level][slot].next = wheel[level][slot].prev = &wheel[level][slot];
+    pthread_t t;
+    if (pthread_create(&t, NULL, &wheel_fun, NULL) != 0) {
+        printf("Thread error\n");
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+void tw_init(pTimer t, tw_fn fn, void *arg) {
+    t->next = t->prev = NULL;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void tw_add(pTimer t, unsigned long ms) {
+    unsigned long ticks = (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    prof_lock(&wheel_lock);
+    if (t->next)
+        unlink_timer(t);
+    t->expires = now_tick + (ticks ? ticks : 1); // the current slot is already being run
+    place(t);
+    prof_unlock(&wheel_lock);
+}
+
+int tw_del(pTimer t) {
+    int armed = 0;
+    prof_lock(&wheel_lock);
+    if (t->next) {
+        unlink_timer(t);
+        armed = 1;
+    }
+    prof_unlock(&wheel_lock);
+    return armed;
+}
+
+unsigned long tw_now(void) {
+    return __atomic_load_n(&now_tick, __ATOMIC_RELAXED);
+}
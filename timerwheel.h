@@ -0,0 +1,33 @@
+/*
+** timerwheel.h -- hierarchical timing wheel for connection and request timeouts
+*/
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#define TW_TICK_MS 10 // resolution of every timeout
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4   // 64^4 ticks, about 46 hours at 10ms
+
+// called from the wheel thread with the wheel locked: keep it short and don't
+// add or delete timers from it. Returns 0, or ms after which to run it again.
+typedef unsigned long (*tw_fn)(void *arg);
+
+// embedded in the object it times, so arming a timer never allocates
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    unsigned long expires; // tick
+    tw_fn fn;
+    void *arg;
+} Timer, *pTimer;
+
+int tw_start(void);
+void tw_init(pTimer t, tw_fn fn, void *arg);
+void tw_add(pTimer t, unsigned long ms); // (re)arms t
+int tw_del(pTimer t);                    // 1 if t was armed; fn is not running when it returns
+unsigned long tw_now(void);              // current tick
+
+#endif
@@ -0,0 +1,158 @@
+/*
+** topology.c -- cpu/NUMA topology and placement of the worker threads
+**
+** The topology is read from /sys/devices/system/node. Without it (or on a
+** single node machine) every online cpu is on node 0.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "topology.h"
+
+static int num_nodes = 0;
+static int node_id[MAX_NODES];       // sysfs number of each node
+static int node_ncpus[MAX_NODES];
+static int *node_cpu[MAX_NODES];     // cpus of each node, ascending
+static int *cpu_node = NULL;         // node index of each cpu, -1 if offline
+static int num_cpus = 0;
+static int pin_policy = PIN_NONE;
+
+static const char *policy_name[] = {"none", "compact", "scatter"};
+
+// "0-3,8-11" -> cpus, returns how many
+static int parse_cpulist(const char *list, int *cpus, int max) {
+    int n = 0;
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p)
+            break;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (long c = lo; c <= hi && n < max; ++c)
+            cpus[n++] = (int) c;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+static void add_node(int id, int *cpus, int n) {
+    node_id[num_nodes] = id;
+    node_ncpus[num_nodes] = n;
+    node_cpu[num_nodes] = malloc(n * sizeof(int));
+    memcpy(node_cpu[num_nodes], cpus, n * sizeof(int));
+    for (int i = 0; i < n; ++i)
+        if (cpus[i] < num_cpus)
+            cpu_node[cpus[i]] = num_nodes;
+    num_nodes++;
+}
+
+int topo_init(int policy) {
+    num_cpus = (int) sysconf(_SC_NPROCESSORS_CONF);
+    cpu_node = malloc(num_cpus * sizeof(int));
+    int *cpus = malloc(num_cpus * sizeof(int));
+    if (cpu_node == NULL || cpus == NULL) {
+        perror("Malloc failed");
+        return -1;
+    }
+    for (int i = 0; i < num_cpus; ++i)
+        cpu_node[i] = -1;
+    pin_policy = policy;
+
+    char path[64], buf[4096];
+    for (int id = 0; id < 1024 && num_nodes < MAX_NODES; ++id) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", id);
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+            continue;
+        if (fgets(buf, sizeof buf, f)) {
+            int n = parse_cpulist(buf, cpus, num_cpus);
+            if (n) // memory-only nodes have no cpus to place threads on
+                add_node(id, cpus, n);
+        }
+        fclose(f);
+    }
+    if (num_nodes == 0) {
+        cpu_set_t set;
+        int n = 0;
+        CPU_ZERO(&set);
+        sched_getaffinity(0, sizeof set, &set);
+        for (int c = 0; c < num_cpus; ++c)
+            if (CPU_ISSET(c, &set))
+                cpus[n++] = c;
+        add_node(0, cpus, n);
+    }
+    free(cpus);
+    return 0;
+}
+
+int topo_nodes(void) {
+    return num_nodes;
+}
+
+int topo_node_id(int node) {
+    return node_id[node];
+}
+
+int topo_cpu_node(int cpu) {
+    if (cpu < 0 || cpu >= num_cpus || cpu_node[cpu] < 0)
+        return 0;
+    return cpu_node[cpu];
+}
+
+int topo_place(pthread_attr_t *attr, unsigned int idx) {
+    int node, cpu;
+    if (pin_policy == PIN_NONE || num_nodes == 0)
+        return -1;
+    if (pin_policy == PIN_SCATTER) {
+        node = idx % num_nodes;
+        cpu = node_cpu[node][(idx / num_nodes) % node_ncpus[node]];
+    } else {
+        int total = 0;
+        for (int i = 0; i < num_nodes; ++i)
+            total += node_ncpus[i];
+        idx %= total;
+        for (node = 0; idx >= (unsigned int) node_ncpus[node]; ++node)
+            idx -= node_ncpus[node];
+        cpu = node_cpu[node][idx];
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_attr_setaffinity_np(attr, sizeof set, &set) != 0) {
+        printf("topology: failed to pin to cpu %d\n", cpu);
+        return -1;
+    }
+    return node;
+}
+
+int topo_policy(const char *name) {
+    for (int i = 0; i < 3; ++i)
+        if (!strcmp(name, policy_name[i]))
+            return i;
+    return -1;
+}
+
+void topo_report(void) {
+    printf("topology: %d cpu(s) on %d NUMA node(s), pinning: %s\n",
+           (int) sysconf(_SC_NPROCESSORS_ONLN), num_nodes, policy_name[pin_policy]);
+    for (int i = 0; i < num_nodes; ++i) {
+        printf("  node%d:", node_id[i]);
+        for (int j = 0; j < node_ncpus[i]; ++j) {
+            int lo = node_cpu[i][j];
+            while (j + 1 < node_ncpus[i] && node_cpu[i][j + 1] == node_cpu[i][j] + 1)
+                j++;
+            if (node_cpu[i][j] == lo)
+                printf(" %d", lo);
+            else
+                printf(" %d-%d", lo, node_cpu[i][j]);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,24 @@
+/*
+** topology.h -- cpu/NUMA topology and placement of the worker threads
+*/
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+
+#define MAX_NODES 64
+
+#define PIN_NONE 0    // let the scheduler move threads around
+#define PIN_COMPACT 1 // fill the cpus of node 0, then node 1, ...
+#define PIN_SCATTER 2 // round robin over the nodes
+
+int topo_init(int policy);
+int topo_nodes(void);
+int topo_node_id(int node); // sysfs number of the node
+int topo_cpu_node(int cpu);
+int topo_place(pthread_attr_t *attr, unsigned int idx); // node of thread idx, -1 if not pinned
+int topo_policy(const char *name);                      // -1 if unknown
+void topo_report(void);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+** trace.c -- records incoming commands to a compact binary file
+**
+** Workers never block on the file: they claim a slot of a bounded ring
+** (one CAS) and copy the payload in. A single writer thread drains the ring
+** to disk. When the ring is full the record is dropped and counted.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+typedef struct TraceSlot {
+    unsigned long seq;
+    TraceRecord rec;
+} TraceSlot;
+
+static TraceSlot ring[TRACE_SLOTS];
+static unsigned long enqueue_pos = 0;
+static unsigned long dequeue_pos = 0;
+static unsigned long dropped = 0;
+static int tracing = 0;
+static int stopping = 0;
+static FILE *trace_file = NULL;
+static pthread_t writer;
+static struct timespec start;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) (ts.tv_sec - start.tv_sec) * 1000000000ULL + ts.tv_nsec - start.tv_nsec;
+}
+
+static void put_varint(FILE *f, uint64_t v) {
+    while (v >= 0x80) {
+        fputc((int) (v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc((int) v, f);
+}
+
+static int get_varint(FILE *f, uint64_t *v) {
+    int c, shift = 0;
+    *v = 0;
+    while ((c = fgetc(f)) != EOF) {
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 1;
+        shift += 7;
+        if (shift > 63)
+            return 0;
+    }
+    return 0;
+}
+
+// returns 1 if a record was written
+static int drain_one(uint64_t *last_ts) {
+    TraceSlot *slot = &ring[dequeue_pos & (TRACE_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1)
+        return 0;
+    int64_t delta = (int64_t) (slot->rec.ts - *last_ts);
+    put_varint(trace_file, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63)); // zigzag
+    put_varint(trace_file, slot->rec.conn);
+    put_varint(trace_file, slot->rec.len);
+    fwrite(slot->rec.data, 1, slot->rec.len, trace_file);
+    *last_ts = slot->rec.ts;
+    __atomic_store_n(&slot->seq, dequeue_pos + TRACE_SLOTS, __ATOMIC_RELEASE);
+    dequeue_pos++;
+    return 1;
+}
+
+static void *writer_fun(void *arg) {
+    (void) arg;
+    uint64_t last_ts = 0;
+    struct timespec nap = {0, 1000000}; // 1ms
+    while (1) {
+        int n = 0;
+        while (drain_one(&last_ts))
+            n++;
+        if (n)
+            continue;
+        fflush(trace_file);
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+            break;
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+int trace_open(const char *path) {
+    if ((trace_file = fopen(path, "wb")) == NULL) {
+        perror("trace: fopen");
+        return -1;
+    }
+    setvbuf(trace_file, NULL, _IOFBF, 1 << 20);
+    fwrite(TRACE_MAGIC, 1, 8, trace_file);
+    for (unsigned long i = 0; i < TRACE_SLOTS; ++i)
+        ring[i].seq = i;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_create(&writer, NULL, &writer_fun, NULL) != 0) {
+        printf("trace: thread error\n");
+        fclose(trace_file);
+        return -1;
+    }
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    printf("trace: recording to '%s'\n", path);
+    return 0;
+}
+
+static void record_one(uint32_t conn, const char *data, uint32_t len) {
+    unsigned long pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    TraceSlot *slot;
+    while (1) {
+        slot = &ring[pos & (TRACE_SLOTS - 1)];
+        long diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) { // ring full, the writer is behind
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->rec.ts = now_ns();
+    slot->rec.conn = conn;
+    slot->rec.len = len;
+    memcpy(slot->rec.data, data, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// a recv larger than TRACE_MAX_DATA is recorded as consecutive records
+void trace_record(uint32_t conn, const char *data, uint32_t len) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_ACQUIRE))
+        return;
+    while (len > 0) {
+        uint32_t n = len > TRACE_MAX_DATA ? TRACE_MAX_DATA : len;
+        record_one(conn, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+void trace_close(void) {
+    if (!__atomic_exchange_n(&tracing, 0, __ATOMIC_ACQ_REL))
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    fclose(trace_file);
+    printf("trace: closed, %lu records dropped (ring full)\n", dropped);
+}
+
+int trace_read_header(FILE *f) {
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0)
+        return -1;
+    return 0;
+}
+
+// returns 1 on a record, 0 at end of file, -1 on a corrupt record
+int trace_read_record(FILE *f, pTraceRecord rec, uint64_t *last_ts) {
+    uint64_t zz, conn, len;
+    if (!get_varint(f, &zz))
+        return 0;
+    if (!get_varint(f, &conn) || !get_varint(f, &len) || len > TRACE_MAX_DATA)
+        return -1;
+    *last_ts += (uint64_t) ((int64_t) (zz >> 1) ^ -(int64_t) (zz & 1));
+    rec->ts = *last_ts;
+    rec->conn = (uint32_t) conn;
+    rec->len = (uint32_t) len;
+    if (fread(rec->data, 1, len, f) != len)
+        return -1;
+    return 1;
+}
@@ -0,0 +1,40 @@
+/*
+** trace.h -- binary trace of the commands received by the server
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "STKTRC01" // 8 bytes at the start of every trace file
+
+#define TRACE_SLOTS 4096 // records buffered between the workers and the writer (power of 2)
+
+#define TRACE_MAX_DATA 1024 // largest payload of one record
+
+/*
+ * File layout: TRACE_MAGIC, then one record per recv() (per TRACE_MAX_DATA bytes of it):
+ *   varint  zigzag delta of the timestamp (ns) from the previous record
+ *   varint  connection id
+ *   varint  payload length
+ *   bytes   payload, exactly as received
+ */
+typedef struct TraceRecord {
+    uint64_t ts;    // ns since the trace was opened
+    uint32_t conn;  // connection id given by the server
+    uint32_t len;
+    char data[TRACE_MAX_DATA];
+} TraceRecord, *pTraceRecord;
+
+// recording side (server)
+int trace_open(const char *path);
+void trace_record(uint32_t conn, const char *data, uint32_t len);
+void trace_close(void);
+
+// reading side (replay)
+int trace_read_header(FILE *f);
+int trace_read_record(FILE *f, pTraceRecord rec, uint64_t *last_ts);
+
+#endif